@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+
+#include "glog/logging.h"
+
+#include "byte_source.h"
+
+namespace rs {
+
+namespace {
+
+// the fixed part of a gzip header with the length of the extra field
+const size_t kGzipHeaderSize = 12;
+
+// Returns the number of bytes, which is less than size only at the end
+// of the file.
+size_t read_fd(int fd, const std::string& filename,
+               char* buffer, size_t size) {
+  size_t total = 0;
+  while (total < size) {
+    ssize_t n = ::read(fd, buffer + total, size - total);
+    if (n < 0 && errno == EINTR) continue;
+    PLOG_IF(FATAL, n < 0) << "Failed to read file " << filename;
+    if (n == 0) break;
+    total += n;
+  }
+  return total;
+}
+
+size_t read_header(const std::string& filename, unsigned char* header,
+                   size_t size) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  LOG_IF(FATAL, fd < 0) << "Failed to open file " << filename;
+  size_t n = read_fd(fd, filename, reinterpret_cast<char*>(header), size);
+  close(fd);
+  return n;
+}
+
+}  // namespace
+
+bool is_gzip_file(const std::string& filename) {
+  unsigned char header[2];
+  return read_header(filename, header, 2) == 2 &&
+      header[0] == 0x1f && header[1] == 0x8b;
+}
+
+ByteSource* open_byte_source(const std::string& filename,
+                             int decompress_threads) {
+  unsigned char header[18];
+  size_t n = read_header(filename, header, sizeof(header));
+  if (n < 2 || header[0] != 0x1f || header[1] != 0x8b) {
+    return new FileByteSource(filename);
+  }
+  if (decompress_threads > 0 && BgzfByteSource::is_bgzf_header(header, n)) {
+    LOG(INFO) << "Decompressing " << filename << " with "
+              << decompress_threads << " threads";
+    return new BgzfByteSource(filename, decompress_threads);
+  }
+  return new GzipByteSource(filename);
+}
+
+FileByteSource::FileByteSource(const std::string& filename)
+  : file_(filename) {
+  fd_ = open(file_.c_str(), O_RDONLY);
+  LOG_IF(FATAL, fd_ < 0) << "Failed to open file " << file_;
+}
+
+FileByteSource::~FileByteSource() {
+  close(fd_);
+}
+
+size_t FileByteSource::read(char* buffer, size_t size) {
+  ssize_t n;
+  do {
+    n = ::read(fd_, buffer, size);
+  } while (n < 0 && errno == EINTR);
+  PLOG_IF(FATAL, n < 0) << "Failed to read file " << file_;
+  return n;
+}
+
+GzipByteSource::GzipByteSource(const std::string& filename)
+  : file_(filename) {
+  gz_ = gzopen(file_.c_str(), "rb");
+  LOG_IF(FATAL, gz_ == nullptr) << "Failed to open file " << file_;
+  gzbuffer(gz_, 1024 * 1024);
+}
+
+GzipByteSource::~GzipByteSource() {
+  gzclose(gz_);
+}
+
+size_t GzipByteSource::read(char* buffer, size_t size) {
+  int n = gzread(gz_, buffer, std::min<size_t>(size, INT_MAX));
+  if (n < 0) {
+    int error;
+    LOG(FATAL) << "Failed to decompress file " << file_ << ": "
+               << gzerror(gz_, &error);
+  }
+  return n;
+}
+
+BgzfByteSource::BgzfByteSource(const std::string& filename, int num_threads)
+  : file_(filename), max_blocks_(num_threads * 16), offset_(0),
+    eof_(false), stopped_(false) {
+  fd_ = open(file_.c_str(), O_RDONLY);
+  LOG_IF(FATAL, fd_ < 0) << "Failed to open file " << file_;
+  for (int i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&BgzfByteSource::run_worker, this);
+  }
+}
+
+BgzfByteSource::~BgzfByteSource() {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    stopped_ = true;
+  }
+  space_ready_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  close(fd_);
+}
+
+bool BgzfByteSource::is_bgzf_header(const unsigned char* header,
+                                    size_t size) {
+  // the extra field (FLG.FEXTRA) contains the subfield 'BC'
+  return size >= 16 && header[0] == 0x1f && header[1] == 0x8b &&
+      header[2] == 8 && (header[3] & 4) != 0 &&
+      header[12] == 'B' && header[13] == 'C' &&
+      header[14] == 2 && header[15] == 0;
+}
+
+bool BgzfByteSource::read_block(std::string* compressed) {
+  compressed->resize(kGzipHeaderSize);
+  size_t n = read_fd(fd_, file_, &compressed->at(0), kGzipHeaderSize);
+  if (n == 0) return false;
+  const unsigned char* header =
+      reinterpret_cast<const unsigned char*>(compressed->data());
+  LOG_IF(FATAL, n != kGzipHeaderSize || header[0] != 0x1f ||
+         header[1] != 0x8b || (header[3] & 4) == 0)
+    << "Broken BGZF block in file " << file_;
+  size_t extra_length = header[10] | (header[11] << 8);
+  compressed->resize(kGzipHeaderSize + extra_length);
+  n = read_fd(fd_, file_, &compressed->at(kGzipHeaderSize), extra_length);
+  LOG_IF(FATAL, n != extra_length) << "Broken BGZF block in file " << file_;
+
+  // find the block size in the subfields of the extra field
+  const unsigned char* extra =
+      reinterpret_cast<const unsigned char*>(compressed->data()) +
+      kGzipHeaderSize;
+  size_t block_size = 0;
+  for (size_t i = 0; i + 4 <= extra_length;) {
+    size_t subfield_length = extra[i + 2] | (extra[i + 3] << 8);
+    if (extra[i] == 'B' && extra[i + 1] == 'C' && subfield_length == 2 &&
+        i + 6 <= extra_length) {
+      block_size = (extra[i + 4] | (extra[i + 5] << 8)) + 1;
+      break;
+    }
+    i += 4 + subfield_length;
+  }
+  LOG_IF(FATAL, block_size <= compressed->size())
+    << "Not a BGZF block in file " << file_;
+  size_t header_size = compressed->size();
+  compressed->resize(block_size);
+  n = read_fd(fd_, file_, &compressed->at(header_size),
+              block_size - header_size);
+  LOG_IF(FATAL, n != block_size - header_size)
+    << "Truncated BGZF block in file " << file_;
+  return true;
+}
+
+void BgzfByteSource::run_worker() {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 + MAX_WBITS: decode the gzip header and check the crc32
+  LOG_IF(FATAL, inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+    << "Failed to initialize zlib";
+  std::string compressed;
+  while (true) {
+    Block* block;
+    {
+      std::unique_lock<std::mutex> lock(m_);
+      space_ready_.wait(lock, [this] {
+          return stopped_ || eof_ || blocks_.size() < max_blocks_;
+        });
+      if (stopped_ || eof_) break;
+      if (!read_block(&compressed)) {
+        eof_ = true;
+        block_ready_.notify_all();
+        space_ready_.notify_all();
+        break;
+      }
+      // the other threads only append blocks, and the block can not be
+      // removed before it is ready, so the pointer stays valid.
+      blocks_.push_back(Block());
+      block = &blocks_.back();
+      block->compressed.swap(compressed);
+      block->ready = false;
+    }
+
+    const std::string& input = block->compressed;
+    size_t size = input.size();
+    // the last four bytes are the size of the decompressed data
+    uint32_t data_size =
+        static_cast<unsigned char>(input[size - 4]) |
+        (static_cast<unsigned char>(input[size - 3]) << 8) |
+        (static_cast<unsigned char>(input[size - 2]) << 16) |
+        (static_cast<uint32_t>(static_cast<unsigned char>(input[size - 1]))
+         << 24);
+    block->data.resize(data_size);
+    inflateReset(&stream);
+    stream.next_in = (Bytef*) input.data();
+    stream.avail_in = size;
+    stream.next_out = (Bytef*) &block->data[0];
+    stream.avail_out = data_size;
+    int ret = inflate(&stream, Z_FINISH);
+    LOG_IF(FATAL, ret != Z_STREAM_END || stream.avail_out != 0)
+      << "Failed to decompress a BGZF block in file " << file_;
+
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      block->compressed.clear();
+      block->ready = true;
+    }
+    block_ready_.notify_all();
+  }
+  inflateEnd(&stream);
+}
+
+size_t BgzfByteSource::read(char* buffer, size_t size) {
+  size_t total = 0;
+  std::unique_lock<std::mutex> lock(m_);
+  while (total < size) {
+    block_ready_.wait(lock, [this] {
+        return (!blocks_.empty() && blocks_.front().ready) ||
+            (blocks_.empty() && eof_);
+      });
+    if (blocks_.empty()) break;
+    Block& block = blocks_.front();
+    size_t n = std::min(size - total, block.data.size() - offset_);
+    memcpy(buffer + total, block.data.data() + offset_, n);
+    total += n;
+    offset_ += n;
+    if (offset_ == block.data.size()) {
+      blocks_.pop_front();
+      offset_ = 0;
+      space_ready_.notify_one();
+    }
+  }
+  return total;
+}
+
+}  // namespace rs
@@ -0,0 +1,95 @@
+// This is used for reading the bytes of a file, which may be gzip
+// compressed. Blocked gzip (BGZF) files are decompressed by multiple
+// threads, so the decompression runs together with the parsing.
+
+#ifndef RS_BYTE_SOURCE_H
+#define RS_BYTE_SOURCE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+namespace rs {
+
+// None of the byte sources is thread safe.
+class ByteSource {
+ public:
+  virtual ~ByteSource() {}
+  // Reads at most size bytes into buffer.
+  // Returns the number of bytes, and 0 at the end of the file.
+  virtual size_t read(char* buffer, size_t size) = 0;
+};
+
+// Returns a byte source of the decompressed bytes if the file is gzip
+// compressed, otherwise returns the bytes of the file.
+ByteSource* open_byte_source(const std::string& filename,
+                             int decompress_threads);
+bool is_gzip_file(const std::string& filename);
+
+class FileByteSource : public ByteSource {
+ public:
+  explicit FileByteSource(const std::string& filename);
+  ~FileByteSource();
+  size_t read(char* buffer, size_t size);
+ private:
+  std::string file_;
+  int fd_;
+};
+
+class GzipByteSource : public ByteSource {
+ public:
+  explicit GzipByteSource(const std::string& filename);
+  ~GzipByteSource();
+  size_t read(char* buffer, size_t size);
+ private:
+  std::string file_;
+  gzFile gz_;
+};
+
+// A BGZF file is a series of gzip members (blocks) of at most 64KB,
+// and the size of every block is stored in its header. The worker
+// threads read the compressed blocks in turn and inflate them at the
+// same time, and read() returns the blocks in the order of the file.
+class BgzfByteSource : public ByteSource {
+ public:
+  BgzfByteSource(const std::string& filename, int num_threads);
+  ~BgzfByteSource();
+  size_t read(char* buffer, size_t size);
+
+  static bool is_bgzf_header(const unsigned char* header, size_t size);
+ private:
+  struct Block {
+    std::string compressed;
+    std::string data;
+    bool ready;
+  };
+
+  void run_worker();
+  // Reads the next compressed block of the file, returns false at the
+  // end of the file. The lock must be held.
+  bool read_block(std::string* compressed);
+
+  std::string file_;
+  int fd_;
+  std::vector<std::thread> workers_;
+  // the blocks are in the order of the file
+  std::deque<Block> blocks_;
+  // the maximum number of blocks in blocks_
+  size_t max_blocks_;
+  // the number of bytes of blocks_.front() returned by read()
+  size_t offset_;
+  bool eof_;
+  bool stopped_;
+  std::mutex m_;
+  std::condition_variable block_ready_;
+  std::condition_variable space_ready_;
+};
+
+}  // namespace rs
+
+#endif  // RS_BYTE_SOURCE_H
@@ -0,0 +1,128 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include "gtest/gtest.h"
+
+#include "byte_source.h"
+
+namespace rs {
+namespace {
+
+using std::string;
+
+string test_content(int size) {
+  string content;
+  for (int i = 0; i < size; i++) {
+    content.push_back(i % 61 == 60 ? '\n' : "ACGT"[(i * 7 + i / 13) % 4]);
+  }
+  return content;
+}
+
+void write_plain(const string& filename, const string& content) {
+  std::ofstream out(filename.c_str());
+  out << content;
+}
+
+void write_gzip(const string& filename, const string& content) {
+  gzFile gz = gzopen(filename.c_str(), "wb");
+  gzwrite(gz, content.data(), content.size());
+  gzclose(gz);
+}
+
+void append_uint16(string* s, uint32_t v) {
+  s->push_back(v & 0xff);
+  s->push_back((v >> 8) & 0xff);
+}
+
+void append_uint32(string* s, uint32_t v) {
+  append_uint16(s, v & 0xffff);
+  append_uint16(s, v >> 16);
+}
+
+// A BGZF block is a gzip member with the block size in the 'BC'
+// subfield of the extra field.
+string bgzf_block(const string& data) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+               Z_DEFAULT_STRATEGY);
+  string deflated(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = (Bytef*) data.data();
+  stream.avail_in = data.size();
+  stream.next_out = (Bytef*) &deflated[0];
+  stream.avail_out = deflated.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  deflated.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  string block = {'\x1f', '\x8b', 8, 4, 0, 0, 0, 0, 0, '\xff'};
+  append_uint16(&block, 6);
+  block += "BC";
+  append_uint16(&block, 2);
+  append_uint16(&block, 18 + deflated.size() + 8 - 1);
+  block += deflated;
+  append_uint32(&block, crc32(0, (const Bytef*) data.data(), data.size()));
+  append_uint32(&block, data.size());
+  return block;
+}
+
+void write_bgzf(const string& filename, const string& content,
+                int block_size) {
+  string file;
+  for (size_t i = 0; i < content.size(); i += block_size) {
+    file += bgzf_block(content.substr(i, block_size));
+  }
+  // the empty block at the end of a BGZF file
+  file += bgzf_block("");
+  write_plain(filename, file);
+}
+
+string read_all(ByteSource* source, int read_size) {
+  string all;
+  string buffer(read_size, '\0');
+  size_t n;
+  while ((n = source->read(&buffer[0], read_size)) > 0) {
+    all.append(buffer.data(), n);
+  }
+  return all;
+}
+
+TEST(ByteSource, plain_and_gzip) {
+  string filename = "byte_source_test.tmp";
+  string content = test_content(100000);
+  write_plain(filename, content);
+  EXPECT_FALSE(is_gzip_file(filename));
+  std::unique_ptr<ByteSource> source(open_byte_source(filename, 4));
+  EXPECT_EQ(content, read_all(source.get(), 1000));
+
+  write_gzip(filename, content);
+  EXPECT_TRUE(is_gzip_file(filename));
+  source.reset(open_byte_source(filename, 4));
+  EXPECT_EQ(content, read_all(source.get(), 1000));
+  source.reset();
+  remove(filename.c_str());
+}
+
+TEST(ByteSource, bgzf) {
+  string filename = "byte_source_test.tmp";
+  string content = test_content(1000000);
+  write_bgzf(filename, content, 65280);
+  EXPECT_TRUE(is_gzip_file(filename));
+  for (int threads = 0; threads <= 8; threads += 4) {
+    for (int read_size : {7, 100000}) {
+      // the plain gzip reader is used without any decompress thread
+      std::unique_ptr<ByteSource> source(open_byte_source(filename, threads));
+      EXPECT_EQ(content, read_all(source.get(), read_size));
+    }
+  }
+  // stop before reading all the blocks
+  BgzfByteSource source(filename, 4);
+  char buffer[10];
+  EXPECT_EQ(10, source.read(buffer, 10));
+  EXPECT_EQ(content.substr(0, 10), string(buffer, 10));
+  remove(filename.c_str());
+}
+
+}  // namespace
+}  // namespace rs
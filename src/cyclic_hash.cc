@@ -0,0 +1,122 @@
+#include <algorithm>
+
+#include "cyclic_hash.h"
+
+namespace rs {
+
+namespace {
+
+struct CharHashTable {
+  CharHashTable() {
+    // the values are generated by splitmix64 with a fixed seed
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    for (int c = 0; c < 256; c++) {
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      values[c] = z ^ (z >> 31);
+    }
+  }
+  uint64_t values[256];
+};
+
+// Multiplies x by the polynomial x^r.
+uint64_t shift_by(uint64_t x, int r) {
+  for (int i = 0; i < r; i++) {
+    x = cyclic_shift(x);
+  }
+  return x;
+}
+
+}  // namespace
+
+const uint64_t* cyclic_char_hash() {
+  static const CharHashTable table;
+  return table.values;
+}
+
+CyclicHash::CyclicHash(int size)
+  : size_(size), state_(0), char_hash_(cyclic_char_hash()) {
+  for (int c = 0; c < 256; c++) {
+    out_hash_[c] = shift_by(char_hash_[c], size_);
+  }
+}
+
+CyclicHash::HashValueType CyclicHash::hash(const StringPiece& key) {
+  reset();
+  const char* p_limit = key.data() + key.size();
+  for (const char* p = key.data(); p < p_limit; p++) {
+    eat(*p);
+  }
+  return hash_value();
+}
+
+void CyclicHash::eat(char inchar) {
+  state_ = cyclic_shift(state_) ^ char_hash_[static_cast<uint8_t>(inchar)];
+}
+
+void CyclicHash::reset() {
+  state_ = 0;
+}
+
+CanonicalCyclicHash::CanonicalCyclicHash(int size)
+  : size_(size), char_hash_(cyclic_char_hash()) {
+  for (int c = 0; c < 256; c++) {
+    complement_char_[c] = c;
+    out_hash_[c] = shift_by(char_hash_[c], size_);
+    last_hash_[c] = shift_by(char_hash_[c], size_ - 1);
+  }
+  complement_char_['A'] = 'T';
+  complement_char_['T'] = 'A';
+  complement_char_['C'] = 'G';
+  complement_char_['G'] = 'C';
+  reset();
+}
+
+CanonicalCyclicHash::HashValueType CanonicalCyclicHash::hash(
+    const StringPiece& key) {
+  reset();
+  const char* p_limit = key.data() + key.size();
+  for (const char* p = key.data(); p < p_limit; p++) {
+    eat(*p);
+  }
+  return hash_value();
+}
+
+void CanonicalCyclicHash::eat(char inchar) {
+  uint8_t c = inchar, cc = complement_char_[c];
+  forward_ = cyclic_shift(forward_) ^ char_hash_[c];
+  complement_ = cyclic_shift(complement_) ^ char_hash_[cc];
+  // every character is shifted by size - 1 and then divided by x once
+  // for every character eaten after it
+  reverse_ = cyclic_unshift(reverse_) ^ last_hash_[c];
+  reverse_complement_ = cyclic_unshift(reverse_complement_) ^
+      last_hash_[cc];
+}
+
+CanonicalCyclicHash::HashValueType CanonicalCyclicHash::update(
+    char inchar, char outchar) {
+  uint8_t in = inchar, out = outchar;
+  uint8_t cin = complement_char_[in], cout = complement_char_[out];
+  forward_ = cyclic_shift(forward_) ^ out_hash_[out] ^ char_hash_[in];
+  complement_ = cyclic_shift(complement_) ^ out_hash_[cout] ^
+      char_hash_[cin];
+  // the first character is not shifted in the reverse window, and all
+  // the others are shifted by one less
+  reverse_ = cyclic_unshift(reverse_ ^ char_hash_[out]) ^ last_hash_[in];
+  reverse_complement_ =
+      cyclic_unshift(reverse_complement_ ^ char_hash_[cout]) ^
+      last_hash_[cin];
+  return hash_value();
+}
+
+CanonicalCyclicHash::HashValueType CanonicalCyclicHash::hash_value() const {
+  return mix_hash(std::min(std::min(forward_, complement_),
+                             std::min(reverse_, reverse_complement_)));
+}
+
+void CanonicalCyclicHash::reset() {
+  forward_ = complement_ = reverse_ = reverse_complement_ = 0;
+}
+
+}  // namespace rs
@@ -0,0 +1,99 @@
+// This is a 64-bit rolling hash of the windows of a string, which is
+// updated in O(1) when the window moves by one character, for any
+// window size and character. It is a cyclic polynomial hash (buzhash),
+// but the polynomial is taken modulo a primitive polynomial of degree
+// 64 over GF(2) instead of x^64 + 1. With x^64 + 1 (rotating by one bit
+// for every character) the characters i and i + 64 of a window longer
+// than 64 are rotated by the same number of bits and cancel out.
+
+#ifndef RS_CYCLIC_HASH_H
+#define RS_CYCLIC_HASH_H
+
+#include <cstdint>
+
+#include "mix_hash.h"
+#include "stringpiece.h"
+
+namespace rs {
+
+// The random values of the 256 characters, which are the same in every
+// run.
+const uint64_t* cyclic_char_hash();
+
+// The lower 64 bits of the primitive polynomial x^64 + x^4 + x^3 + x + 1,
+// so the powers of x only repeat every 2^64 - 1 characters.
+const uint64_t kCyclicPolynomial = 0x1bULL;
+
+// Multiplies x by the polynomial x.
+inline uint64_t cyclic_shift(uint64_t x) {
+  return (x << 1) ^ (kCyclicPolynomial & (0 - (x >> 63)));
+}
+
+// Divides x by the polynomial x, which undoes cyclic_shift.
+inline uint64_t cyclic_unshift(uint64_t x) {
+  return (x >> 1) ^
+      (((kCyclicPolynomial >> 1) | (1ULL << 63)) & (0 - (x & 1)));
+}
+
+class CyclicHash {
+ public:
+  typedef uint64_t HashValueType;
+  explicit CyclicHash(int size);
+  HashValueType hash(const StringPiece& key);
+  void eat(char inchar);
+  // outchar is the first character of the window, which is dropped.
+  HashValueType update(char inchar, char outchar) {
+    state_ = cyclic_shift(state_) ^
+        out_hash_[static_cast<uint8_t>(outchar)] ^
+        char_hash_[static_cast<uint8_t>(inchar)];
+    return hash_value();
+  }
+  // The state is mixed, so that every bit of the hash value depends on
+  // all the characters.
+  HashValueType hash_value() const { return mix_hash(state_); }
+  void reset();
+ private:
+  uint32_t size_;
+  uint64_t state_;
+  const uint64_t* char_hash_;
+  // the values of the characters shifted by the size of the window
+  uint64_t out_hash_[256];
+};
+
+// The same as CyclicHash, but the hash value of a window is the same
+// as the ones of its reverse, its complement and its reverse complement
+// (the characters other than A, C, G and T are their own complements),
+// so a sequence is hashed in all the four orientations in one pass.
+class CanonicalCyclicHash {
+ public:
+  typedef uint64_t HashValueType;
+  explicit CanonicalCyclicHash(int size);
+  // The key must have size characters.
+  HashValueType hash(const StringPiece& key);
+  // The hash value is the canonical one when size characters are eaten
+  // after reset, and no more can be.
+  void eat(char inchar);
+  HashValueType update(char inchar, char outchar);
+  HashValueType hash_value() const;
+  void reset();
+ private:
+  uint32_t size_;
+  const uint64_t* char_hash_;
+  // the state of the window and its complement, in which the first
+  // character is shifted the most
+  uint64_t forward_;
+  uint64_t complement_;
+  // the state of the reverse window and the reverse complement, in
+  // which the last character is shifted the most
+  uint64_t reverse_;
+  uint64_t reverse_complement_;
+  // the complement of every character
+  uint8_t complement_char_[256];
+  // the values of the characters shifted by size and size - 1
+  uint64_t out_hash_[256];
+  uint64_t last_hash_[256];
+};
+
+}  // namespace rs
+
+#endif  // RS_CYCLIC_HASH_H
@@ -0,0 +1,98 @@
+#include <set>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "cyclic_hash.h"
+
+using std::string;
+namespace rs {
+namespace {
+
+TEST(CyclicHash, update) {
+  string seq = "GCCATGGAGATTGTGACCCTTTAGTTCNCCCTAATGTTTGGTTCTCTTACTGTTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAACagct";
+  int sizes[] = {1, 31, 40, 63, 64, 65, 90};
+  for (int k : sizes) {
+    CyclicHash rolling(k), hasher(k);
+    uint64_t h = rolling.hash(StringPiece(seq.data(), k));
+    for (size_t start = 1; start + k <= seq.size(); start++) {
+      ASSERT_EQ(h, hasher.hash(StringPiece(seq.data() + start - 1, k)));
+      h = rolling.update(seq[start + k - 1], seq[start - 1]);
+    }
+    ASSERT_EQ(h, hasher.hash(StringPiece(seq.data() + seq.size() - k, k)));
+  }
+}
+
+TEST(CyclicHash, distinct) {
+  // all the 8-mers of ACGT
+  CyclicHash hasher(8);
+  std::set<uint64_t> values;
+  string key(8, 'A');
+  for (int i = 0; i < (1 << 16); i++) {
+    for (int j = 0; j < 8; j++) {
+      key[j] = "ACGT"[(i >> (2 * j)) & 3];
+    }
+    values.insert(hasher.hash(key));
+  }
+  ASSERT_EQ(1u << 16, values.size());
+}
+
+TEST(CyclicHash, long_windows) {
+  // The first and the last characters of a 65-mer (or a 129-mer) would
+  // cancel out if the characters 64 apart were shifted the same.
+  string middle = "GCCATGGAGATTGTGACCCTTTAGTTCNCCCTAATGTTTGGTTCTCTTACTGTTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAACAGCTTGCAAGTCCAGATTAGGCATTGACCAGGTT";
+  int sizes[] = {65, 129};
+  for (int k : sizes) {
+    string m = middle.substr(0, k - 2);
+    CyclicHash hasher(k);
+    CanonicalCyclicHash canonical_hasher(k);
+    ASSERT_NE(hasher.hash("A" + m + "A"), hasher.hash("T" + m + "T"));
+    ASSERT_NE(hasher.hash("A" + m + "A"), hasher.hash("C" + m + "C"));
+    ASSERT_NE(canonical_hasher.hash("A" + m + "A"),
+              canonical_hasher.hash("T" + m + "T"));
+    ASSERT_NE(canonical_hasher.hash("A" + m + "A"),
+              canonical_hasher.hash("C" + m + "C"));
+  }
+}
+
+string complement(const string& seq) {
+  string result = seq;
+  for (auto& c : result) {
+    switch (c) {
+    case 'A': c = 'T'; break;
+    case 'T': c = 'A'; break;
+    case 'C': c = 'G'; break;
+    case 'G': c = 'C'; break;
+    }
+  }
+  return result;
+}
+
+TEST(CanonicalCyclicHash, orientations) {
+  string seq = "GCCATGGAGATTGTGACCCTTTAGTTCNCCCTAATGTTTGGTTCTCTTACTGTTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAAC";
+  int sizes[] = {1, 31, 40, 64, 65, 90};
+  for (int k : sizes) {
+    CanonicalCyclicHash rolling(k), hasher(k);
+    std::set<uint64_t> values;
+    uint64_t h = rolling.hash(StringPiece(seq.data(), k));
+    for (size_t start = 0; start + k <= seq.size(); start++) {
+      if (start > 0) {
+        h = rolling.update(seq[start + k - 1], seq[start - 1]);
+      }
+      string window = seq.substr(start, k);
+      ASSERT_EQ(h, hasher.hash(window));
+      string reversed(window.rbegin(), window.rend());
+      ASSERT_EQ(h, hasher.hash(reversed));
+      ASSERT_EQ(h, hasher.hash(complement(window)));
+      ASSERT_EQ(h, hasher.hash(complement(reversed)));
+      values.insert(h);
+    }
+    // the windows are distinct (except the 1-mers)
+    if (k > 1) {
+      ASSERT_EQ(seq.size() - k + 1, values.size());
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rs
@@ -1,29 +1,44 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
+#include <algorithm>
+
 #include "fa_reader.h"
 #include "glog/logging.h"
 
 namespace rs {
 
 const int BufferSize = 10000;
+const int kChunkerBufferBytes = 1024 * 1024 * 16;
+const size_t kPrefetchBytes = 1024 * 1024 * 16;
 
 SingleFastaReader::SingleFastaReader(const string& file,
                                      int buffer_size)
-  : file_(file), fd_(nullptr), buffer_size_(buffer_size) {
+  : file_(file), fd_(nullptr), buffer_size_(buffer_size), next_record_(0) {
   fd_.open(file_.c_str(), ios::in);
   LOG_IF(FATAL, !fd_.good()) << "Failed to open file " << file_;
   fd_.rdbuf()->pubsetbuf(buffer, 1024 * 1024 * 5);
 }
 
-int SingleFastaReader::read(vector<string>* ids, vector<string>* seqs) {
+int SingleFastaReader::read(vector<string>* ids, vector<string>* seqs,
+                            size_t* first_record) {
   ids->clear(), seqs->clear();
   string id;
   string read;
   int total_reads = 0;
   std::lock_guard<std::mutex> lock(m_);
-  while(!fd_.eof()) {
-    fd_ >> id >> read;
+  if (first_record != nullptr) {
+    *first_record = next_record_;
+  }
+  // the extraction fails at the end of the file, and then id and read
+  // still hold the last record, which must not be added again.
+  while(fd_ >> id >> read) {
     // only add if the line is not empty
     if (read.size() > 2) {
       // remove the first letter in fasta file. (should be either '>'
@@ -36,94 +51,295 @@ int SingleFastaReader::read(vector<string>* ids, vector<string>* seqs) {
     }
     if (total_reads >= buffer_size_) break;
   }
+  next_record_ += total_reads;
   return total_reads;
 }
 
 void SingleFastaReader::reset() {
   fd_.clear(); fd_.seekg(0);
+  next_record_ = 0;
 }
 
 
+RecordChunker::RecordChunker(const string& filename, int lines_per_record,
+                             bool use_mmap, int buffer_bytes,
+                             int decompress_threads)
+  : file_(filename), source_(nullptr), lines_per_record_(lines_per_record),
+    mapped_(nullptr), mapped_size_(0), begin_(0), end_(0) {
+  if (use_mmap && is_gzip_file(file_)) {
+    LOG(INFO) << "Cannot mmap the compressed file " << file_
+              << ", read it instead.";
+    use_mmap = false;
+  }
+  if (use_mmap) {
+    int fd = open(file_.c_str(), O_RDONLY);
+    LOG_IF(FATAL, fd < 0) << "Failed to open file " << file_;
+    struct stat st;
+    PLOG_IF(FATAL, fstat(fd, &st) != 0) << "Failed to stat file " << file_;
+    mapped_size_ = end_ = st.st_size;
+    if (end_ > 0) {
+      void* addr = mmap(nullptr, end_, PROT_READ, MAP_PRIVATE, fd, 0);
+      PLOG_IF(FATAL, addr == MAP_FAILED) << "Failed to mmap file " << file_;
+      madvise(addr, end_, MADV_SEQUENTIAL);
+      mapped_ = static_cast<char*>(addr);
+    }
+    close(fd);
+    data_ = mapped_;
+  } else {
+    source_ = open_byte_source(file_, decompress_threads);
+    buffer_.resize(buffer_bytes);
+    data_ = buffer_.data();
+  }
+}
+
+RecordChunker::~RecordChunker() {
+  if (mapped_ != nullptr) {
+    munmap(mapped_, mapped_size_);
+  }
+  delete source_;
+}
+
+bool RecordChunker::fill() {
+  // in the mmap mode, the whole file is already in the memory
+  if (buffer_.empty()) return false;
+  // move the unconsumed bytes to the beginning of the buffer
+  if (begin_ > 0) {
+    std::copy(buffer_.begin() + begin_, buffer_.begin() + end_,
+              buffer_.begin());
+    end_ -= begin_;
+    begin_ = 0;
+  }
+  // a single record is larger than the buffer
+  if (end_ == buffer_.size()) {
+    buffer_.resize(buffer_.size() * 2);
+  }
+  data_ = buffer_.data();
+  size_t n = source_->read(buffer_.data() + end_, buffer_.size() - end_);
+  end_ += n;
+  return n > 0;
+}
+
+void RecordChunker::prefetch() {
+  if (buffer_.empty()) {
+    if (mapped_ != nullptr) {
+      madvise(mapped_, std::min(mapped_size_, kPrefetchBytes), MADV_WILLNEED);
+    }
+  } else {
+    fill();
+  }
+}
+
+int RecordChunker::next(int max_records, StringPiece* chunk,
+                        string* storage) {
+  storage->clear();
+  int total_records = 0;
+  // the number of new lines found in the current record
+  int lines = 0;
+  size_t scanned = begin_;
+  // the end of the last whole record
+  size_t record_end = begin_;
+  while (total_records < max_records) {
+    const char* p = static_cast<const char*>(
+        memchr(data_ + scanned, '\n', end_ - scanned));
+    if (p != nullptr) {
+      scanned = p - data_ + 1;
+      if (++lines == lines_per_record_) {
+        lines = 0;
+        record_end = scanned;
+        total_records ++;
+      }
+      continue;
+    }
+    size_t partial = scanned - record_end;
+    if (!buffer_.empty()) {
+      // Keep the whole records, since fill() moves the remaining bytes.
+      storage->append(data_ + begin_, record_end - begin_);
+      begin_ = record_end;
+    }
+    bool has_more = fill();
+    if (!buffer_.empty()) {
+      // fill() moved the remaining bytes to begin_
+      record_end = begin_;
+    }
+    if (!has_more) {
+      // the last record may not end with a new line character
+      bool is_empty = std::all_of(data_ + record_end, data_ + end_,
+                                  [](char c) { return isspace(c); });
+      if (!is_empty) {
+        total_records ++;
+      }
+      record_end = end_;
+      break;
+    }
+    scanned = record_end + partial;
+  }
+  if (!buffer_.empty()) {
+    storage->append(data_ + begin_, record_end - begin_);
+    chunk->set(storage->data(), storage->size());
+  } else {
+    chunk->set(data_ + begin_, record_end - begin_);
+  }
+  begin_ = record_end;
+  return total_records;
+}
+
 RSPairReader::RSPairReader(const std::vector<std::string>& files1,
                            const std::vector<std::string>& files2,
-                           int buffer_size)
-  : files1_(files1), files2_(files2),
-    fd1_(nullptr), fd2_(nullptr), buffer_size_(buffer_size) {
+                           int buffer_size, bool use_mmap,
+                           int decompress_threads)
+  : files1_(files1), files2_(files2), use_mmap_(use_mmap),
+    decompress_threads_(decompress_threads), lines_per_record_(2),
+    buffer_size_(buffer_size) {
+  init();
+}
 
-  LOG_IF(INFO, files1.size() != files2.size())
-    << "Different size of paired files. Use single read mode.";
-  LOG_IF(FATAL, files1.size() != 1)
-    << "Cannot support more than one fasta file yet";
-  LOG_IF(FATAL, files1.size() == 0)
+RSPairReader::RSPairReader(const std::vector<std::string>& files1,
+                           const std::vector<std::string>& files2,
+                           int buffer_size, bool use_mmap,
+                           int decompress_threads, int lines_per_record)
+  : files1_(files1), files2_(files2), use_mmap_(use_mmap),
+    decompress_threads_(decompress_threads),
+    lines_per_record_(lines_per_record), buffer_size_(buffer_size) {
+  init();
+}
+
+void RSPairReader::init() {
+  LOG_IF(FATAL, files1_.size() == 0)
     << "No input files";
+  LOG_IF(INFO, files1_.size() != files2_.size())
+    << "Different size of paired files. Use single read mode.";
   current_file_idx_ = 0;
-  fd1_.open(files1_[current_file_idx_].c_str(), ios::in);
-  LOG_IF(FATAL, !fd1_.good()) << "Failed to open file "
-                              << files1_[current_file_idx_];
-  if (files2.size() != 0) {
-    fd2_.open(files2_[current_file_idx_].c_str(), ios::in);
-    LOG_IF(FATAL, !fd2_.good()) << "Failed to open file "
-                                << files2_[current_file_idx_];
+  next_chunker1_ = next_chunker2_ = nullptr;
+  open_files(current_file_idx_, &chunker1_, &chunker2_);
+  start_prefetch();
+  total_time = 0;
+}
+
+void RSPairReader::open_files(int file_idx, RecordChunker** chunker1,
+                              RecordChunker** chunker2) {
+  *chunker1 = new RecordChunker(files1_[file_idx], lines_per_record_,
+                                use_mmap_, kChunkerBufferBytes,
+                                decompress_threads_);
+  *chunker2 = nullptr;
+  if (files1_.size() == files2_.size()) {
+    *chunker2 = new RecordChunker(files2_[file_idx], lines_per_record_,
+                                  use_mmap_, kChunkerBufferBytes,
+                                  decompress_threads_);
   }
+}
 
-  fd1_.rdbuf()->pubsetbuf(buffer1, 1024 * 1024 * 20);
-  fd2_.rdbuf()->pubsetbuf(buffer2, 1024 * 1024 * 20);
+void RSPairReader::start_prefetch() {
+  int next_idx = current_file_idx_ + 1;
+  if (next_idx >= static_cast<int>(files1_.size())) return;
+  prefetch_thread_ = std::thread([this, next_idx]() {
+      open_files(next_idx, &next_chunker1_, &next_chunker2_);
+      next_chunker1_->prefetch();
+      if (next_chunker2_ != nullptr) next_chunker2_->prefetch();
+    });
+}
 
-  total_time = 0;
+bool RSPairReader::next_files() {
+  if (!prefetch_thread_.joinable()) return false;
+  prefetch_thread_.join();
+  if (use_mmap_) {
+    finished_chunkers_.push_back(chunker1_);
+    finished_chunkers_.push_back(chunker2_);
+  } else {
+    delete chunker1_;
+    delete chunker2_;
+  }
+  chunker1_ = next_chunker1_;
+  chunker2_ = next_chunker2_;
+  next_chunker1_ = next_chunker2_ = nullptr;
+  current_file_idx_ ++;
+  LOG(INFO) << "Reading " << files1_[current_file_idx_];
+  start_prefetch();
+  return true;
+}
+
+RSPairReader::~RSPairReader() {
+  if (prefetch_thread_.joinable()) {
+    prefetch_thread_.join();
+  }
+  delete chunker1_;
+  delete chunker2_;
+  delete next_chunker1_;
+  delete next_chunker2_;
+  for (auto chunker : finished_chunkers_) {
+    delete chunker;
+  }
 }
 
 // Return the number of reads
-int RSPairReader::read(vector<string>* reads1, vector<string>* reads2) {
+int RSPairReader::read(ReadBatch* batch) {
   struct timeval start_time, end_time;
   gettimeofday(&start_time, NULL);
-
-  std::lock_guard<std::mutex> lock(m_);
-
-  int total_reads = read_from_fd(fd1_, reads1);
-  if (fd2_.good()) {
-    read_from_fd(fd2_, reads2);
+  batch->reads1.clear(), batch->reads2.clear();
+  StringPiece chunk1, chunk2;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    int total_reads = chunker1_->next(buffer_size_, &chunk1, &batch->chunk1);
+    // a batch never crosses the end of a file
+    while (total_reads == 0 && next_files()) {
+      total_reads = chunker1_->next(buffer_size_, &chunk1, &batch->chunk1);
+    }
+    if (chunker2_ != nullptr) {
+      // read the mates of the same reads to keep the pairs in sync
+      int total_mates = chunker2_->next(total_reads, &chunk2,
+                                        &batch->chunk2);
+      LOG_IF(ERROR, total_mates != total_reads)
+        << "The paired files have different numbers of reads.";
+    }
+    gettimeofday(&end_time, NULL);
+    total_time += end_time.tv_sec - start_time.tv_sec + (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
   }
-  gettimeofday(&end_time, NULL);
-  total_time += end_time.tv_sec - start_time.tv_sec + (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
-  return total_reads;
+  parse_chunk(chunk1, lines_per_record_, &batch->reads1);
+  parse_chunk(chunk2, lines_per_record_, &batch->reads2);
+  return batch->reads1.size();
 }
 
-int RSPairReader::read_from_fd(fstream &fd, vector<string> * reads) {
-  int total_reads = 0;
-  reads->resize(buffer_size_);
-  while(!fd.eof()) {
-    // ignore the id line
-    fd.ignore(256 * 256,'\n');
-    fd >> reads->at(total_reads);
-    // ignore the remaining new line character
-    fd.ignore(256 * 256,'\n');
-
-    read_quality_score(fd);
-    // only add if the line is not empty
-    if (reads->at(total_reads).size() > 2) {
-      total_reads ++;
-    } else {
-      break;
-    }
-    if (total_reads >= buffer_size_) break;
+int RSPairReader::read(vector<string>* reads1, vector<string>* reads2) {
+  ReadBatch batch;
+  int total_reads = read(&batch);
+  reads1->clear(), reads2->clear();
+  for (auto& read : batch.reads1) {
+    reads1->push_back(read.ToString());
+  }
+  for (auto& read : batch.reads2) {
+    reads2->push_back(read.ToString());
   }
-  reads->resize(total_reads);
   return total_reads;
 }
 
-void RSPairReader::read_quality_score(fstream& fd) {
-  // does nothing
-  // no quality score lines in fasta files
+void RSPairReader::parse_chunk(const StringPiece& chunk, int lines_per_record,
+                               vector<StringPiece>* reads) {
+  const char* p = chunk.data();
+  const char* p_limit = chunk.data() + chunk.size();
+  int line = 0;
+  while (p < p_limit) {
+    const char* line_end = static_cast<const char*>(
+        memchr(p, '\n', p_limit - p));
+    // the last line may not end with a new line character
+    if (line_end == nullptr) line_end = p_limit;
+    // the sequence is the second line of every record
+    if (line % lines_per_record == 1) {
+      const char* seq_end = line_end;
+      if (seq_end > p && *(seq_end - 1) == '\r') seq_end --;
+      // only add if the line is not empty
+      if (seq_end - p > 2) {
+        reads->emplace_back(p, seq_end - p);
+      }
+    }
+    line ++;
+    p = line_end + 1;
+  }
 }
 
 RSFastqPairReader::RSFastqPairReader(const std::vector<std::string>& files1,
                                      const std::vector<std::string>& files2,
-                                     int buffer_size)
-  : RSPairReader(files1, files2, buffer_size) {}
-
-void RSFastqPairReader::read_quality_score(fstream& fd) {
-  fd.ignore(256 * 256,'\n');
-  fd.ignore(256 * 256,'\n');
-}
+                                     int buffer_size, bool use_mmap,
+                                     int decompress_threads)
+  : RSPairReader(files1, files2, buffer_size, use_mmap,
+                 decompress_threads, 4) {}
 
 }  // namespace rs
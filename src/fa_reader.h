@@ -8,8 +8,10 @@
 #include <fstream>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "byte_source.h"
 #include "stringpiece.h"
 
 using std::fstream;
@@ -24,7 +26,11 @@ namespace rs {
   public:
     SingleFastaReader(const std::string& filename,
                       int buffer_size = 50000);
-    int read(std::vector<std::string>* ids, std::vector<std::string>* seq);
+    // first_record is set to the index of the first record read, if
+    // it is not nullptr, so that the records read by the threads can be
+    // put in the order of the file.
+    int read(std::vector<std::string>* ids, std::vector<std::string>* seq,
+             size_t* first_record = nullptr);
     void reset();
   private:
     std::string file_;
@@ -32,41 +38,127 @@ namespace rs {
     char buffer [1024 * 1024 * 5];
     mutable std::mutex m_;
     int buffer_size_;
+    // the index of the next record
+    size_t next_record_;
   };
 
-  // TODO(zzj): support multiple files
+  // Reads the raw bytes of whole records from a file, so that the
+  // records can be parsed later without holding any lock.
+  // In the mmap mode, the whole file is mapped into memory and the
+  // chunks point into the mapped file, so no byte is copied.
+  // Gzip compressed files are decompressed while reading (they cannot
+  // be mapped), and BGZF files are decompressed by decompress_threads
+  // threads.
+  // This is NOT thread safe.
+  class RecordChunker {
+  public:
+    RecordChunker(const std::string& filename, int lines_per_record,
+                  bool use_mmap = false,
+                  int buffer_bytes = 1024 * 1024 * 16,
+                  int decompress_threads = 0);
+    ~RecordChunker();
+
+    // Sets chunk to the bytes of at most max_records records. Unless
+    // in the mmap mode, the bytes are copied into storage, and chunk
+    // is only valid until storage is changed.
+    // Returns the number of records.
+    int next(int max_records, StringPiece* chunk, std::string* storage);
+
+    // Reads the beginning of the file ahead of time, so that the first
+    // chunk does not wait for the disk (or the decompression).
+    void prefetch();
+  private:
+    // Reads more bytes into the buffer, and returns false at the end of
+    // the file.
+    bool fill();
+
+    std::string file_;
+    // nullptr if it is in the mmap mode
+    ByteSource* source_;
+    int lines_per_record_;
+    std::vector<char> buffer_;
+    // the mapped file, nullptr if it is not in the mmap mode
+    char* mapped_;
+    size_t mapped_size_;
+    // either buffer_.data() or mapped_
+    const char* data_;
+    // data_[begin_, end_) has not been consumed.
+    size_t begin_;
+    size_t end_;
+  };
+
+  // A batch of reads. Every read points to either the chunks of the
+  // batch or the memory mapped input files.
+  struct ReadBatch {
+    std::string chunk1;
+    std::string chunk2;
+    std::vector<StringPiece> reads1;
+    std::vector<StringPiece> reads2;
+  };
+
+  // The files of a mate are read one by one as a single stream, and
+  // the next files are opened and prefetched in the background while
+  // the current ones are being read.
   class RSPairReader {
   public:
     RSPairReader(const std::vector<std::string>& files1,
                  const std::vector<std::string>& files2,
-                 int buffer_size = 50000);
+                 int buffer_size = 50000, bool use_mmap = false,
+                 int decompress_threads = 0);
+    virtual ~RSPairReader();
 
-    // This is thread safe
+    // This is thread safe. Only the raw bytes are read under the lock,
+    // and the reads are parsed in the calling thread.
+    int read(ReadBatch* batch);
     int read(vector<string>* reads1, vector<string>* reads2);
+
+    // Appends the sequences of the records in the chunk to reads.
+    static void parse_chunk(const StringPiece& chunk, int lines_per_record,
+                            vector<StringPiece>* reads);
+  protected:
+    RSPairReader(const std::vector<std::string>& files1,
+                 const std::vector<std::string>& files2,
+                 int buffer_size, bool use_mmap, int decompress_threads,
+                 int lines_per_record);
   private:
+    void init();
+    void open_files(int file_idx, RecordChunker** chunker1,
+                    RecordChunker** chunker2);
+    // Opens and prefetches the files after the current ones in
+    // prefetch_thread_.
+    void start_prefetch();
+    // Switches to the next files. Returns false if there are no more
+    // files. The lock must be held.
+    bool next_files();
+
     std::vector<std::string> files1_;
     std::vector<std::string> files2_;
-  protected:
-    virtual void read_quality_score(fstream& fd);
-    int read_from_fd(fstream& fd, vector<string>* reads);
-    fstream fd1_;
-    fstream fd2_;
-  private:
-    char buffer1 [1024 * 1024 * 5];
-    char buffer2 [1024 * 1024 * 5];
+    RecordChunker* chunker1_;
+    RecordChunker* chunker2_;
+    // the chunkers of the next files, which are set by prefetch_thread_
+    RecordChunker* next_chunker1_;
+    RecordChunker* next_chunker2_;
+    std::thread prefetch_thread_;
+    // In the mmap mode, the reads of the finished files may still be in
+    // use, so their chunkers are kept until the reader is deleted.
+    std::vector<RecordChunker*> finished_chunkers_;
+    bool use_mmap_;
+    int decompress_threads_;
+    int lines_per_record_;
     int current_file_idx_;
     mutable std::mutex m_;
     int buffer_size_;
     double total_time;
   };
 
+  // There are four lines per record (the id, the sequence, '+' and the
+  // quality scores) in fastq files.
   class RSFastqPairReader : public RSPairReader {
   public:
     RSFastqPairReader(const std::vector<std::string>& files1,
                       const std::vector<std::string>& files2,
-                      int buffer_size = 50000);
-  protected:
-    virtual void read_quality_score(fstream& fd);
+                      int buffer_size = 50000, bool use_mmap = false,
+                      int decompress_threads = 0);
   };
 }  // namespace rs
 
@@ -1,3 +1,6 @@
+#include <atomic>
+#include <cstdio>
+#include <fstream>
 #include <thread>
 #include "gtest/gtest.h"
 
@@ -7,7 +10,181 @@
 namespace rs {
 namespace {
 
-  // Add tests for the readers
+// The sequence of the ith read. The mate is the same sequence in
+// lower case, so the pairs can be checked.
+string test_read(int i) {
+  string seq;
+  for (int j = 0; j < 30 + i % 7; j++) {
+    seq.push_back("ACGT"[(i >> (j % 16)) & 3]);
+  }
+  return seq;
+}
+
+string mate_of(const string& seq) {
+  string mate = seq;
+  for (auto& c : mate) c = tolower(c);
+  return mate;
+}
+
+void write_fastq(const string& filename, int num_reads, bool is_mate,
+                 int first_read = 0) {
+  std::ofstream out(filename.c_str());
+  for (int i = first_read; i < first_read + num_reads; i++) {
+    string seq = is_mate ? mate_of(test_read(i)) : test_read(i);
+    out << "@read" << i << "\n" << seq << "\n+\n" << string(seq.size(), 'I');
+    // the last record does not end with a new line character
+    if (i != first_read + num_reads - 1) out << "\n";
+  }
+}
+
+TEST(SingleFastaReader, first_record) {
+  SingleFastaReader reader("test_data/gene_fasta_example.fa", 2);
+  vector<string> ids, seqs;
+  size_t first_record, expected = 0;
+  int n;
+  while ((n = reader.read(&ids, &seqs, &first_record)) != 0) {
+    ASSERT_EQ(expected, first_record);
+    expected += n;
+  }
+  ASSERT_EQ(5, expected);
+  reader.reset();
+  ASSERT_EQ(2, reader.read(&ids, &seqs, &first_record));
+  ASSERT_EQ(0, first_record);
+}
+
+TEST(RecordChunker, split_at_record_boundary) {
+  string filename = "fa_reader_test.tmp.fq";
+  write_fastq(filename, 10, false);
+  for (bool use_mmap : {false, true}) {
+    RecordChunker chunker(filename, 4, use_mmap);
+    vector<int> sizes;
+    vector<StringPiece> reads;
+    StringPiece chunk;
+    string storage, all_chunks;
+    int n;
+    while ((n = chunker.next(3, &chunk, &storage)) != 0) {
+      sizes.push_back(n);
+      all_chunks.append(chunk.data(), chunk.size());
+    }
+    ASSERT_EQ(vector<int>({3, 3, 3, 1}), sizes);
+    RSPairReader::parse_chunk(all_chunks, 4, &reads);
+    ASSERT_EQ(10, reads.size());
+    for (int i = 0; i < 10; i++) {
+      ASSERT_EQ(test_read(i), reads[i].ToString());
+    }
+  }
+  std::remove(filename.c_str());
+}
+
+TEST(RecordChunker, small_buffer) {
+  string filename = "fa_reader_test.tmp.fq";
+  write_fastq(filename, 1000, false);
+  // a record is larger than the buffer, and most records cross the
+  // end of the buffer.
+  RecordChunker chunker(filename, 4, false, 16);
+  vector<StringPiece> reads;
+  StringPiece chunk;
+  string storage, all_chunks;
+  int total = 0;
+  int n;
+  while ((n = chunker.next(7, &chunk, &storage)) != 0) {
+    total += n;
+    all_chunks.append(chunk.data(), chunk.size());
+  }
+  ASSERT_EQ(1000, total);
+  RSPairReader::parse_chunk(all_chunks, 4, &reads);
+  ASSERT_EQ(1000, reads.size());
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(test_read(i), reads[i].ToString());
+  }
+  std::remove(filename.c_str());
+}
+
+TEST(RSPairReader, fasta_test) {
+  vector<string> files1 = {"test_data/fa_reader_test.fasta.1"};
+  vector<string> files2 = {"test_data/fa_reader_test.fasta.2"};
+  RSPairReader reader(files1, files2, 300);
+  vector<string> reads1, reads2;
+  int total = 0;
+  int n;
+  while ((n = reader.read(&reads1, &reads2)) != 0) {
+    ASSERT_EQ(reads1.size(), reads2.size());
+    ASSERT_EQ(n, reads1.size());
+    total += n;
+  }
+  ASSERT_EQ(1000, total);
+}
+
+class PairReaderThread : public ThreadInterface {
+public:
+  PairReaderThread(RSPairReader* reader, std::atomic<int>* total)
+    : reader_(reader), total_(total) {}
+
+  void run() {
+    ReadBatch batch;
+    while (reader_->read(&batch) != 0) {
+      ASSERT_EQ(batch.reads1.size(), batch.reads2.size());
+      for (size_t i = 0; i < batch.reads1.size(); i++) {
+        ASSERT_EQ(mate_of(batch.reads1[i].ToString()),
+                  batch.reads2[i].ToString());
+      }
+      total_->fetch_add(batch.reads1.size());
+    }
+  }
+private:
+  RSPairReader* reader_;
+  std::atomic<int>* total_;
+};
+
+TEST(RSFastqPairReader, multi_thread_test) {
+  int num_reads = 20000;
+  vector<string> files1 = {"fa_reader_test.tmp.fq.1"};
+  vector<string> files2 = {"fa_reader_test.tmp.fq.2"};
+  write_fastq(files1[0], num_reads, false);
+  write_fastq(files2[0], num_reads, true);
+  for (bool use_mmap : {false, true}) {
+    RSFastqPairReader reader(files1, files2, 100, use_mmap);
+    std::atomic<int> total(0);
+    PairReaderThread reader_thread(&reader, &total);
+    vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+      threads.emplace_back(std::thread{RSThread(&reader_thread)});
+    }
+    barrier(threads);
+    ASSERT_EQ(num_reads, total.load());
+  }
+  std::remove(files1[0].c_str());
+  std::remove(files2[0].c_str());
+}
+
+TEST(RSFastqPairReader, multi_file_test) {
+  // the second file is empty
+  vector<int> num_reads = {7000, 0, 12345, 1};
+  vector<string> files1, files2;
+  int first_read = 0;
+  for (size_t i = 0; i < num_reads.size(); i++) {
+    files1.push_back("fa_reader_test.tmp.fq.1." + std::to_string(i));
+    files2.push_back("fa_reader_test.tmp.fq.2." + std::to_string(i));
+    write_fastq(files1[i], num_reads[i], false, first_read);
+    write_fastq(files2[i], num_reads[i], true, first_read);
+    first_read += num_reads[i];
+  }
+  for (bool use_mmap : {false, true}) {
+    RSFastqPairReader reader(files1, files2, 100, use_mmap);
+    std::atomic<int> total(0);
+    PairReaderThread reader_thread(&reader, &total);
+    vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+      threads.emplace_back(std::thread{RSThread(&reader_thread)});
+    }
+    barrier(threads);
+    ASSERT_EQ(first_read, total.load());
+  }
+  for (size_t i = 0; i < num_reads.size(); i++) {
+    std::remove(files1[i].c_str());
+    std::remove(files2[i].c_str());
+  }
+}
 
 }  // namespace
 }  // namespace rs
@@ -0,0 +1,463 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "glog/logging.h"
+#include "key_table.h"
+#include "packed_kmer.h"
+
+namespace rs {
+
+namespace {
+
+// The last two characters are the version of the format.
+const char kKeyTableMagic[8] = {'R', 'S', 'K', 'E', 'Y', 'S', '0', '2'};
+const size_t kKeyTableVersionOffset = 6;
+
+// A key table file is the header, and then the columns in the order of
+// KeyTableColumns, every one of which starts at an 8-byte aligned
+// offset.
+struct KeyTableHeader {
+  char magic[8];
+  uint32_t key_length;
+  uint32_t num_raw_keys;
+  uint64_t num_genes;
+  uint64_t num_transcripts;
+  uint64_t num_keys;
+  uint64_t num_infos;
+  uint64_t num_positions;
+  uint64_t num_string_bytes;
+};
+
+static_assert(sizeof(KeyTableHeader) == 64,
+              "The header of the key table file should be 64 bytes");
+
+const int kNumColumns = 13;
+
+const char kSampleCountsMagic[8] = {'R', 'S', 'C', 'N', 'T', 'S', '0', '1'};
+
+// A sample counts file is the header, and then the counts.
+struct SampleCountsHeader {
+  char magic[8];
+  uint64_t fingerprint;
+  uint64_t num_keys;
+  uint64_t padding;
+};
+
+static_assert(sizeof(SampleCountsHeader) == 32,
+              "The header of the sample counts file should be 32 bytes");
+
+const uint64_t kFingerprintSeed = 14695981039346656037ULL;
+const size_t kFingerprintBlockBytes = 1024 * 1024;
+
+// FNV-1a on 64-bit words. The size of the data must be a multiple of 8
+// except for the last part of the data.
+uint64_t hash_bytes(const char* data, size_t size, uint64_t h) {
+  const uint64_t kPrime = 1099511628211ULL;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    h = (h ^ word) * kPrime;
+    h ^= h >> 32;
+  }
+  for (; i < size; i++) {
+    h = (h ^ static_cast<uint8_t>(data[i])) * kPrime;
+  }
+  return h;
+}
+
+size_t align8(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+size_t packed_key_bytes(uint64_t key_length) {
+  return (key_length + 3) / 4;
+}
+
+// The offsets of the CSR columns are 32-bit.
+uint32_t checked_offset(size_t offset) {
+  LOG_IF(FATAL, offset > UINT32_MAX)
+    << "Too many selected keys for a key table";
+  return offset;
+}
+
+// Appends the key with the nucleotide i in the bits 2 * (i % 4) of the
+// byte i / 4, or returns false (and appends nothing) if it has a
+// character other than A, C, G and T.
+bool pack_key(const string& key, string* packed) {
+  string bytes(packed_key_bytes(key.size()), 0);
+  for (size_t i = 0; i < key.size(); i++) {
+    // The lower case letters are kept as raw keys, so that they are
+    // read back as they are.
+    uint8_t code = nucleotide_code(key[i]);
+    if (code == kInvalidNucleotide || "ACGT"[code] != key[i]) return false;
+    bytes[i / 4] |= code << (2 * (i % 4));
+  }
+  packed->append(bytes);
+  return true;
+}
+
+// Sets the offsets of the columns in the file, and returns the size of
+// the file.
+size_t column_offsets(const KeyTableHeader& header,
+                      size_t offsets[kNumColumns]) {
+  size_t sizes[kNumColumns] = {
+    sizeof(uint32_t) * (header.num_genes + 1),
+    sizeof(uint32_t) * (header.num_genes + 1),
+    sizeof(uint32_t) * (header.num_genes + header.num_transcripts + 1),
+    sizeof(int32_t) * header.num_transcripts,
+    sizeof(uint32_t) * (header.num_keys + 1),
+    sizeof(int32_t) * header.num_infos,
+    sizeof(uint32_t) * (header.num_infos + 1),
+    sizeof(int32_t) * header.num_positions,
+    header.num_string_bytes,
+    packed_key_bytes(header.key_length) * header.num_keys,
+    sizeof(uint32_t) * header.num_raw_keys,
+    header.key_length * header.num_raw_keys,
+    sizeof(int32_t) * header.num_keys,
+  };
+  size_t offset = sizeof(header);
+  for (int i = 0; i < kNumColumns; i++) {
+    offsets[i] = offset;
+    offset = align8(offset + sizes[i]);
+  }
+  return offset;
+}
+
+KeyTableHeader make_header(int key_length, const KeyTableColumns& columns) {
+  KeyTableHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kKeyTableMagic, sizeof(kKeyTableMagic));
+  header.key_length = key_length;
+  header.num_genes = columns.gene_keys.size() - 1;
+  header.num_transcripts = columns.lengths.size();
+  header.num_keys = columns.counts.size();
+  header.num_infos = columns.info_tidx.size();
+  header.num_positions = columns.positions.size();
+  header.num_string_bytes = columns.strings.size();
+  header.num_raw_keys = columns.raw_key_ids.size();
+  return header;
+}
+
+// Writes the zeros up to the offset.
+bool write_padding(size_t offset, FILE* fp) {
+  static const char zeros[8] = {0};
+  long padding = offset - ftell(fp);
+  return padding >= 0 && padding < 8 &&
+      fwrite(zeros, 1, padding, fp) == static_cast<size_t>(padding);
+}
+
+// Writes the column at the offset, after the zeros up to the offset.
+bool write_column(const void* data, size_t size, size_t offset, FILE* fp) {
+  return write_padding(offset, fp) &&
+      (size == 0 || fwrite(data, 1, size, fp) == size);
+}
+
+}  // namespace
+
+KeyTableWriter::KeyTableWriter(int key_length) : key_length_(key_length) {
+  columns_.gene_tids.push_back(0);
+  columns_.gene_keys.push_back(0);
+  columns_.string_offsets.push_back(0);
+  columns_.key_infos.push_back(0);
+  columns_.info_positions.push_back(0);
+}
+
+void KeyTableWriter::add(const SelectedKey& sk) {
+  KeyTableColumns& c = columns_;
+  c.gene_tids.push_back(checked_offset(c.lengths.size() + sk.tids_size()));
+  c.gene_keys.push_back(checked_offset(c.counts.size() + sk.keys_size()));
+  for (int i = 0; i < sk.tids_size(); i++) {
+    c.lengths.push_back(sk.lengths(i));
+  }
+  for (int i = 0; i < sk.keys_size(); i++) {
+    const auto& key = sk.keys(i);
+    LOG_IF(FATAL, (int) key.key().size() != key_length_)
+      << "The length of the key " << key.key() << " is not " << key_length_;
+    if (!pack_key(key.key(), &c.packed_keys)) {
+      c.packed_keys.append(packed_key_bytes(key_length_), 0);
+      c.raw_key_ids.push_back(c.counts.size());
+      c.raw_keys.append(key.key());
+    }
+    c.counts.push_back(key.count());
+    for (int j = 0; j < key.transcript_infos_size(); j++) {
+      const auto& info = key.transcript_infos(j);
+      c.info_tidx.push_back(info.tidx());
+      c.positions.insert(c.positions.end(), info.positions().begin(),
+                         info.positions().end());
+      c.info_positions.push_back(checked_offset(c.positions.size()));
+    }
+    c.key_infos.push_back(checked_offset(c.info_tidx.size()));
+  }
+  c.strings.append(sk.gid());
+  c.string_offsets.push_back(checked_offset(c.strings.size()));
+  for (int i = 0; i < sk.tids_size(); i++) {
+    tid_strings_.append(sk.tids(i));
+    tid_ends_.push_back(checked_offset(tid_strings_.size()));
+  }
+}
+
+void KeyTableWriter::save(const string& filename) const {
+  const KeyTableColumns& c = columns_;
+  KeyTableHeader header = make_header(key_length_, c);
+  header.num_string_bytes += tid_strings_.size();
+  // the transcript ids are after the gene ids
+  string strings = c.strings + tid_strings_;
+  vector<uint32_t> string_offsets = c.string_offsets;
+  for (uint32_t end : tid_ends_) {
+    string_offsets.push_back(checked_offset(c.strings.size() + end));
+  }
+  size_t offsets[kNumColumns];
+  size_t size = column_offsets(header, offsets);
+  const void* data[kNumColumns] = {
+    c.gene_tids.data(), c.gene_keys.data(), string_offsets.data(),
+    c.lengths.data(), c.key_infos.data(), c.info_tidx.data(),
+    c.info_positions.data(), c.positions.data(), strings.data(),
+    c.packed_keys.data(), c.raw_key_ids.data(), c.raw_keys.data(),
+    c.counts.data(),
+  };
+  size_t sizes[kNumColumns] = {
+    sizeof(uint32_t) * c.gene_tids.size(),
+    sizeof(uint32_t) * c.gene_keys.size(),
+    sizeof(uint32_t) * string_offsets.size(),
+    sizeof(int32_t) * c.lengths.size(),
+    sizeof(uint32_t) * c.key_infos.size(),
+    sizeof(int32_t) * c.info_tidx.size(),
+    sizeof(uint32_t) * c.info_positions.size(),
+    sizeof(int32_t) * c.positions.size(),
+    strings.size(),
+    c.packed_keys.size(),
+    sizeof(uint32_t) * c.raw_key_ids.size(),
+    c.raw_keys.size(),
+    sizeof(int32_t) * c.counts.size(),
+  };
+  string tmp_file = filename + ".tmp";
+  FILE* fp = fopen(tmp_file.c_str(), "wb");
+  PLOG_IF(FATAL, fp == nullptr) << "Failed to open " << tmp_file;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (int i = 0; ok && i < kNumColumns; i++) {
+    ok = write_column(data[i], sizes[i], offsets[i], fp);
+  }
+  ok = ok && write_padding(size, fp);
+  ok = fclose(fp) == 0 && ok;
+  PLOG_IF(FATAL, !ok) << "Failed to write " << tmp_file;
+  PLOG_IF(FATAL, rename(tmp_file.c_str(), filename.c_str()) != 0)
+    << "Failed to rename " << tmp_file << " to " << filename;
+}
+
+KeyTable::KeyTable(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  PLOG_IF(FATAL, fd < 0) << "Failed to open the key table " << filename;
+  struct stat st;
+  PLOG_IF(FATAL, fstat(fd, &st) != 0) << "Failed to stat " << filename;
+  mapped_size_ = st.st_size;
+  LOG_IF(FATAL, mapped_size_ < sizeof(KeyTableHeader))
+    << "The key table is broken: " << filename;
+  void* addr = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+  PLOG_IF(FATAL, addr == MAP_FAILED) << "Failed to mmap " << filename;
+  close(fd);
+  mapped_ = static_cast<char*>(addr);
+
+  const KeyTableHeader* header =
+      reinterpret_cast<const KeyTableHeader*>(mapped_);
+  LOG_IF(FATAL, memcmp(header->magic, kKeyTableMagic,
+                       kKeyTableVersionOffset) != 0)
+    << "Not a key table: " << filename;
+  LOG_IF(FATAL, memcmp(header->magic, kKeyTableMagic,
+                       sizeof(kKeyTableMagic)) != 0)
+    << "The key table is of another version, select the keys again: "
+    << filename;
+  size_t offsets[kNumColumns];
+  LOG_IF(FATAL, column_offsets(*header, offsets) != mapped_size_)
+    << "The key table is broken: " << filename;
+  gene_tids_ = reinterpret_cast<const uint32_t*>(mapped_ + offsets[0]);
+  gene_keys_ = reinterpret_cast<const uint32_t*>(mapped_ + offsets[1]);
+  string_offsets_ = reinterpret_cast<const uint32_t*>(mapped_ + offsets[2]);
+  lengths_ = reinterpret_cast<const int32_t*>(mapped_ + offsets[3]);
+  key_infos_ = reinterpret_cast<const uint32_t*>(mapped_ + offsets[4]);
+  info_tidx_ = reinterpret_cast<const int32_t*>(mapped_ + offsets[5]);
+  info_positions_ = reinterpret_cast<const uint32_t*>(mapped_ + offsets[6]);
+  positions_ = reinterpret_cast<const int32_t*>(mapped_ + offsets[7]);
+  strings_ = mapped_ + offsets[8];
+  packed_keys_ = reinterpret_cast<const uint8_t*>(mapped_ + offsets[9]);
+  raw_key_ids_ = reinterpret_cast<const uint32_t*>(mapped_ + offsets[10]);
+  raw_keys_ = mapped_ + offsets[11];
+  counts_ = reinterpret_cast<const int32_t*>(mapped_ + offsets[12]);
+  key_length_ = header->key_length;
+  num_genes_ = header->num_genes;
+  num_keys_ = header->num_keys;
+  num_raw_keys_ = header->num_raw_keys;
+}
+
+KeyTable::~KeyTable() {
+  munmap(mapped_, mapped_size_);
+}
+
+bool KeyTable::is_key_table(const string& filename) {
+  char magic[sizeof(kKeyTableMagic)];
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (fp == nullptr) return false;
+  // a key table of another version is still a key table
+  bool is_table = fread(magic, sizeof(magic), 1, fp) == 1 &&
+      memcmp(magic, kKeyTableMagic, kKeyTableVersionOffset) == 0;
+  fclose(fp);
+  return is_table;
+}
+
+void KeyTable::write_count_file(const string& table_file,
+                                const string& count_file,
+                                const vector<int32_t>& counts) {
+  KeyTable table(table_file);
+  LOG_IF(FATAL, counts.size() != table.num_keys())
+    << "The counts do not match the keys of " << table_file;
+  size_t counts_offset =
+      reinterpret_cast<const char*>(table.counts_) - table.mapped_;
+  string tmp_file = count_file + ".tmp";
+  FILE* fp = fopen(tmp_file.c_str(), "wb");
+  PLOG_IF(FATAL, fp == nullptr) << "Failed to open " << tmp_file;
+  // only the counts are different from the table
+  bool ok = fwrite(table.mapped_, 1, counts_offset, fp) == counts_offset &&
+      write_column(counts.data(), sizeof(int32_t) * counts.size(),
+                   counts_offset, fp) &&
+      write_padding(table.mapped_size_, fp);
+  ok = fclose(fp) == 0 && ok;
+  PLOG_IF(FATAL, !ok) << "Failed to write " << tmp_file;
+  PLOG_IF(FATAL, rename(tmp_file.c_str(), count_file.c_str()) != 0)
+    << "Failed to rename " << tmp_file << " to " << count_file;
+}
+
+void KeyTable::key(uint64_t k, string* key) const {
+  const uint32_t* raw_key_ids_end = raw_key_ids_ + num_raw_keys_;
+  const uint32_t* raw = std::lower_bound(raw_key_ids_, raw_key_ids_end, k);
+  if (raw != raw_key_ids_end && *raw == k) {
+    key->assign(raw_keys_ + (raw - raw_key_ids_) * key_length_, key_length_);
+    return;
+  }
+  const uint8_t* bytes = packed_keys_ + k * packed_key_bytes(key_length_);
+  key->resize(key_length_);
+  for (int i = 0; i < key_length_; i++) {
+    (*key)[i] = "ACGT"[(bytes[i / 4] >> (2 * (i % 4))) & 3];
+  }
+}
+
+void KeyTable::to_selected_key(size_t gene, SelectedKey* sk) const {
+  sk->Clear();
+  const uint32_t* gene_string = string_offsets_ + gene;
+  sk->set_gid(strings_ + gene_string[0], gene_string[1] - gene_string[0]);
+  for (uint64_t t = gene_tids_[gene]; t < gene_tids_[gene + 1]; t++) {
+    const uint32_t* tid = string_offsets_ + num_genes_ + t;
+    sk->add_tids(strings_ + tid[0], tid[1] - tid[0]);
+    sk->add_lengths(lengths_[t]);
+  }
+  for (uint64_t k = gene_keys_[gene]; k < gene_keys_[gene + 1]; k++) {
+    SelectedKey::Key* key = sk->add_keys();
+    this->key(k, key->mutable_key());
+    for (uint64_t i = key_infos_[k]; i < key_infos_[k + 1]; i++) {
+      SelectedKey::Key::TranscriptInfo* info = key->add_transcript_infos();
+      info->set_tidx(info_tidx_[i]);
+      for (uint64_t p = info_positions_[i]; p < info_positions_[i + 1]; p++) {
+        info->add_positions(positions_[p]);
+      }
+    }
+    key->set_count(counts_[k]);
+  }
+}
+
+uint64_t KeyTable::fingerprint() const {
+  return hash_bytes(mapped_, reinterpret_cast<const char*>(counts_) - mapped_,
+                    kFingerprintSeed);
+}
+
+uint64_t selected_keys_fingerprint(const string& filename) {
+  if (KeyTable::is_key_table(filename)) {
+    return KeyTable(filename).fingerprint();
+  }
+  FILE* fp = fopen(filename.c_str(), "rb");
+  PLOG_IF(FATAL, fp == nullptr) << "Failed to open " << filename;
+  vector<char> block(kFingerprintBlockBytes);
+  uint64_t h = kFingerprintSeed;
+  size_t n;
+  while ((n = fread(block.data(), 1, block.size(), fp)) > 0) {
+    h = hash_bytes(block.data(), n, h);
+  }
+  PLOG_IF(FATAL, ferror(fp)) << "Failed to read " << filename;
+  fclose(fp);
+  return h;
+}
+
+void write_sample_counts(const string& filename, uint64_t fingerprint,
+                         const vector<int32_t>& counts) {
+  SampleCountsHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSampleCountsMagic, sizeof(kSampleCountsMagic));
+  header.fingerprint = fingerprint;
+  header.num_keys = counts.size();
+  string tmp_file = filename + ".tmp";
+  FILE* fp = fopen(tmp_file.c_str(), "wb");
+  PLOG_IF(FATAL, fp == nullptr) << "Failed to open " << tmp_file;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+      fwrite(counts.data(), sizeof(int32_t), counts.size(), fp) ==
+      counts.size();
+  ok = fclose(fp) == 0 && ok;
+  PLOG_IF(FATAL, !ok) << "Failed to write " << tmp_file;
+  PLOG_IF(FATAL, rename(tmp_file.c_str(), filename.c_str()) != 0)
+    << "Failed to rename " << tmp_file << " to " << filename;
+}
+
+SampleCounts::SampleCounts(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  PLOG_IF(FATAL, fd < 0) << "Failed to open the sample counts " << filename;
+  struct stat st;
+  PLOG_IF(FATAL, fstat(fd, &st) != 0) << "Failed to stat " << filename;
+  mapped_size_ = st.st_size;
+  LOG_IF(FATAL, mapped_size_ < sizeof(SampleCountsHeader))
+    << "Not a sample counts file: " << filename;
+  void* addr = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+  PLOG_IF(FATAL, addr == MAP_FAILED) << "Failed to mmap " << filename;
+  close(fd);
+  mapped_ = static_cast<char*>(addr);
+
+  const SampleCountsHeader* header =
+      reinterpret_cast<const SampleCountsHeader*>(mapped_);
+  LOG_IF(FATAL, memcmp(header->magic, kSampleCountsMagic,
+                       sizeof(kSampleCountsMagic)) != 0)
+    << "Not a sample counts file: " << filename;
+  fingerprint_ = header->fingerprint;
+  num_keys_ = header->num_keys;
+  LOG_IF(FATAL, mapped_size_ != sizeof(*header) + sizeof(int32_t) * num_keys_)
+    << "The sample counts file is broken: " << filename;
+  counts_ = reinterpret_cast<const int32_t*>(mapped_ + sizeof(*header));
+}
+
+SampleCounts::~SampleCounts() {
+  munmap(mapped_, mapped_size_);
+}
+
+SelectedKeyReader::SelectedKeyReader(const string& filename)
+  : table_(nullptr), reader_(nullptr), next_gene_(0) {
+  if (KeyTable::is_key_table(filename)) {
+    table_ = new KeyTable(filename);
+  } else {
+    reader_ = new ProtobufReader(filename);
+  }
+}
+
+SelectedKeyReader::~SelectedKeyReader() {
+  delete table_;
+  delete reader_;
+}
+
+bool SelectedKeyReader::read(SelectedKey* sk) {
+  if (table_ == nullptr) return reader_->read(sk);
+  if (next_gene_ >= table_->num_genes()) return false;
+  table_->to_selected_key(next_gene_++, sk);
+  return true;
+}
+
+}  // namespace rs
@@ -0,0 +1,159 @@
+// This is a columnar file of the selected keys (and their counts), which
+// is mapped into memory instead of being parsed, and whose counts can be
+// written without writing the rest of the file again. The counts of a
+// sample can also be written alone, next to the fingerprint of the keys.
+
+#ifndef RS_KEY_TABLE_H
+#define RS_KEY_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "proto/rnasigs.pb.h"
+#include "proto_data.h"
+
+using std::string;
+using std::vector;
+
+namespace rs {
+
+// The columns of a key table, in the order they are in the file. The
+// keys of gene g are [gene_keys[g], gene_keys[g + 1]), and the same for
+// the transcripts of a gene, the transcript infos of a key and the
+// positions of a transcript info (CSR style). The strings are the gene
+// ids and then the transcript ids. The counts are the last column.
+struct KeyTableColumns {
+  vector<uint32_t> gene_tids;
+  vector<uint32_t> gene_keys;
+  vector<uint32_t> string_offsets;
+  vector<int32_t> lengths;
+  vector<uint32_t> key_infos;
+  vector<int32_t> info_tidx;
+  vector<uint32_t> info_positions;
+  vector<int32_t> positions;
+  string strings;
+  // the keys of two bits per nucleotide, (key_length + 3) / 4 bytes per
+  // key, which are zeros for a key with a character other than A, C, G
+  // and T
+  string packed_keys;
+  // the ids of the keys that cannot be packed (in increasing order),
+  // and their key_length characters one by one
+  vector<uint32_t> raw_key_ids;
+  string raw_keys;
+  vector<int32_t> counts;
+};
+
+// Builds a key table from the selected keys, one gene after another.
+class KeyTableWriter {
+public:
+  explicit KeyTableWriter(int key_length);
+
+  void add(const SelectedKey& sk);
+  // Writes the key table into the file, through a temporary file, so
+  // other processes never load a partial table.
+  void save(const string& filename) const;
+
+private:
+  int key_length_;
+  // the strings of the columns are only the gene ids until save()
+  KeyTableColumns columns_;
+  string tid_strings_;
+  vector<uint32_t> tid_ends_;
+};
+
+// A key table mapped into memory.
+class KeyTable {
+public:
+  explicit KeyTable(const string& filename);
+  ~KeyTable();
+
+  // Returns true if the file is a key table (instead of a file of the
+  // SelectedKey messages).
+  static bool is_key_table(const string& filename);
+  // Copies the key table into the count file, with the counts of its
+  // keys (in the order of the table) replaced by the counts.
+  static void write_count_file(const string& table_file,
+                               const string& count_file,
+                               const vector<int32_t>& counts);
+
+  int key_length() const { return key_length_; }
+  size_t num_genes() const { return num_genes_; }
+  uint64_t num_keys() const { return num_keys_; }
+  // Sets sk to the gene with its keys and their counts.
+  void to_selected_key(size_t gene, SelectedKey* sk) const;
+  // the hash of the table without the counts
+  uint64_t fingerprint() const;
+
+private:
+  // Sets key to the kth key.
+  void key(uint64_t k, string* key) const;
+
+  char* mapped_;
+  size_t mapped_size_;
+  const uint32_t* gene_tids_;
+  const uint32_t* gene_keys_;
+  const uint32_t* string_offsets_;
+  const int32_t* lengths_;
+  const uint32_t* key_infos_;
+  const int32_t* info_tidx_;
+  const uint32_t* info_positions_;
+  const int32_t* positions_;
+  const char* strings_;
+  const uint8_t* packed_keys_;
+  const uint32_t* raw_key_ids_;
+  const char* raw_keys_;
+  const int32_t* counts_;
+  int key_length_;
+  size_t num_genes_;
+  uint64_t num_keys_;
+  uint64_t num_raw_keys_;
+};
+
+// Returns the fingerprint of the selected keys file of either format,
+// which does not change with the counts of a key table, so a key table
+// and its count files have the same fingerprint.
+uint64_t selected_keys_fingerprint(const string& filename);
+
+// Writes the counts of the keys of a sample (in the order of the
+// selected keys file) with the fingerprint of the selected keys file.
+void write_sample_counts(const string& filename, uint64_t fingerprint,
+                         const vector<int32_t>& counts);
+
+// The counts of a sample mapped into memory.
+class SampleCounts {
+public:
+  explicit SampleCounts(const string& filename);
+  ~SampleCounts();
+
+  uint64_t fingerprint() const { return fingerprint_; }
+  uint64_t num_keys() const { return num_keys_; }
+  const int32_t* counts() const { return counts_; }
+
+private:
+  char* mapped_;
+  size_t mapped_size_;
+  uint64_t fingerprint_;
+  uint64_t num_keys_;
+  const int32_t* counts_;
+};
+
+// Reads the selected keys one gene after another from either a file of
+// the SelectedKey messages or a key table.
+class SelectedKeyReader {
+public:
+  explicit SelectedKeyReader(const string& filename);
+  ~SelectedKeyReader();
+
+  bool read(SelectedKey* sk);
+
+private:
+  KeyTable* table_;
+  ProtobufReader* reader_;
+  size_t next_gene_;
+};
+
+}  // namespace rs
+
+#endif  // RS_KEY_TABLE_H
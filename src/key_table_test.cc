@@ -0,0 +1,192 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "key_table.h"
+#include "proto/rnasigs.pb.h"
+#include "proto_data.h"
+
+using std::string;
+using std::vector;
+namespace rs {
+namespace {
+
+SelectedKey make_selected_key(int i) {
+  SelectedKey sk;
+  sk.set_gid("G" + std::to_string(i));
+  for (int t = 0; t < i % 3 + 1; t++) {
+    sk.add_tids("T" + std::to_string(i) + "." + std::to_string(t));
+    sk.add_lengths(1000 + i + t);
+  }
+  // a gene without any keys
+  if (i == 2) return sk;
+  for (int j = 0; j < i + 1; j++) {
+    SelectedKey::Key* key = sk.add_keys();
+    // some keys cannot be packed
+    key->set_key(string(39, "ACGT"[(i + j) % 4]) + (j % 3 == 1 ? "n" : "G"));
+    for (int t = 0; t < sk.tids_size(); t++) {
+      SelectedKey::Key::TranscriptInfo* info = key->add_transcript_infos();
+      info->set_tidx(t);
+      for (int p = 0; p < t + j % 2; p++) {
+        info->add_positions(p * 10 + j);
+      }
+    }
+    key->set_count(i * j);
+  }
+  return sk;
+}
+
+const int kNumGenes = 5;
+
+void write_key_table(const string& filename) {
+  KeyTableWriter writer(40);
+  for (int i = 0; i < kNumGenes; i++) {
+    writer.add(make_selected_key(i));
+  }
+  writer.save(filename);
+}
+
+TEST(KeyTable, read_written_keys) {
+  string filename = "key_table_test.tmp.keys";
+  write_key_table(filename);
+  ASSERT_TRUE(KeyTable::is_key_table(filename));
+  KeyTable table(filename);
+  ASSERT_EQ(40, table.key_length());
+  ASSERT_EQ(kNumGenes, (int) table.num_genes());
+  SelectedKey sk;
+  uint64_t num_keys = 0;
+  for (int i = 0; i < kNumGenes; i++) {
+    table.to_selected_key(i, &sk);
+    ASSERT_EQ(make_selected_key(i).SerializeAsString(),
+              sk.SerializeAsString());
+    num_keys += sk.keys_size();
+  }
+  ASSERT_EQ(num_keys, table.num_keys());
+  remove(filename.c_str());
+}
+
+TEST(KeyTable, keys_of_any_length) {
+  string filename = "key_table_test.tmp.keys";
+  SelectedKey sk;
+  sk.set_gid("G");
+  // only the first key is packed
+  for (const char* key : {"ACGTACG", "acgtacg", "ACGTNCG"}) {
+    SelectedKey::Key* k = sk.add_keys();
+    k->set_key(key);
+    k->set_count(sk.keys_size());
+  }
+  KeyTableWriter writer(7);
+  writer.add(sk);
+  writer.save(filename);
+  KeyTable table(filename);
+  SelectedKey loaded;
+  table.to_selected_key(0, &loaded);
+  ASSERT_EQ(sk.SerializeAsString(), loaded.SerializeAsString());
+  remove(filename.c_str());
+}
+
+TEST(KeyTable, write_count_file) {
+  string filename = "key_table_test.tmp.keys";
+  string count_file = "key_table_test.tmp.counts";
+  write_key_table(filename);
+  vector<int32_t> counts;
+  {
+    KeyTable table(filename);
+    for (uint64_t i = 0; i < table.num_keys(); i++) {
+      counts.push_back(i * 7 + 1);
+    }
+  }
+  KeyTable::write_count_file(filename, count_file, counts);
+  KeyTable table(count_file);
+  SelectedKey sk;
+  size_t k = 0;
+  for (int i = 0; i < kNumGenes; i++) {
+    SelectedKey expected = make_selected_key(i);
+    for (int j = 0; j < expected.keys_size(); j++) {
+      expected.mutable_keys(j)->set_count(counts[k++]);
+    }
+    table.to_selected_key(i, &sk);
+    ASSERT_EQ(expected.SerializeAsString(), sk.SerializeAsString());
+  }
+  remove(filename.c_str());
+  remove(count_file.c_str());
+}
+
+TEST(SelectedKeyReader, read_both_formats) {
+  string table_file = "key_table_test.tmp.keys";
+  string pb_file = "key_table_test.tmp.pb";
+  write_key_table(table_file);
+  {
+    ProtobufWriter writer(pb_file);
+    for (int i = 0; i < kNumGenes; i++) {
+      writer.write(make_selected_key(i));
+    }
+  }
+  ASSERT_FALSE(KeyTable::is_key_table(pb_file));
+  for (const string& filename : {table_file, pb_file}) {
+    SelectedKeyReader reader(filename);
+    SelectedKey sk;
+    for (int i = 0; i < kNumGenes; i++) {
+      ASSERT_TRUE(reader.read(&sk));
+      ASSERT_EQ(make_selected_key(i).SerializeAsString(),
+                sk.SerializeAsString());
+    }
+    ASSERT_FALSE(reader.read(&sk));
+  }
+  remove(table_file.c_str());
+  remove(pb_file.c_str());
+}
+
+TEST(SampleCounts, read_written_counts) {
+  string table_file = "key_table_test.tmp.keys";
+  string count_file = "key_table_test.tmp.counts";
+  string sample_file = "key_table_test.tmp.sample";
+  write_key_table(table_file);
+  uint64_t fingerprint = selected_keys_fingerprint(table_file);
+  vector<int32_t> counts;
+  {
+    KeyTable table(table_file);
+    for (uint64_t i = 0; i < table.num_keys(); i++) {
+      counts.push_back(i * 3);
+    }
+  }
+  // the counts of a key table do not change its fingerprint
+  KeyTable::write_count_file(table_file, count_file, counts);
+  ASSERT_EQ(fingerprint, selected_keys_fingerprint(count_file));
+
+  write_sample_counts(sample_file, fingerprint, counts);
+  SampleCounts sample(sample_file);
+  ASSERT_EQ(fingerprint, sample.fingerprint());
+  ASSERT_EQ(counts.size(), sample.num_keys());
+  for (size_t i = 0; i < counts.size(); i++) {
+    ASSERT_EQ(counts[i], sample.counts()[i]);
+  }
+  remove(table_file.c_str());
+  remove(count_file.c_str());
+  remove(sample_file.c_str());
+}
+
+TEST(SampleCounts, fingerprint_of_protobuf_files) {
+  string pb_file1 = "key_table_test.tmp.1.pb";
+  string pb_file2 = "key_table_test.tmp.2.pb";
+  for (int n = 0; n < 2; n++) {
+    ProtobufWriter writer(n == 0 ? pb_file1 : pb_file2);
+    for (int i = 0; i < kNumGenes; i++) {
+      SelectedKey sk = make_selected_key(i);
+      // the second file has a different transcript length
+      if (n == 1 && i == 3) sk.set_lengths(0, 1);
+      writer.write(sk);
+    }
+  }
+  ASSERT_EQ(selected_keys_fingerprint(pb_file1),
+            selected_keys_fingerprint(pb_file1));
+  ASSERT_NE(selected_keys_fingerprint(pb_file1),
+            selected_keys_fingerprint(pb_file2));
+  remove(pb_file1.c_str());
+  remove(pb_file2.c_str());
+}
+
+}  // namespace
+}  // namespace rs
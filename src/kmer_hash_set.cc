@@ -0,0 +1,48 @@
+#include "kmer_hash_set.h"
+
+namespace rs {
+
+namespace {
+
+const size_t kInitialSlots = 1024;
+
+}  // namespace
+
+KmerHashSet::KmerHashSet()
+  : slots_(kInitialSlots, 0), mask_(kInitialSlots - 1) {}
+
+bool KmerHashSet::insert(uint64_t hashvalue) {
+  if (hashvalue == 0) hashvalue = 1;
+  // at most half of the slots are used
+  if ((used_.size() + 1) * 2 > slots_.size()) {
+    grow();
+  }
+  uint64_t i = hashvalue & mask_;
+  while (slots_[i] != 0) {
+    if (slots_[i] == hashvalue) return false;
+    i = (i + 1) & mask_;
+  }
+  slots_[i] = hashvalue;
+  used_.push_back(i);
+  return true;
+}
+
+void KmerHashSet::clear() {
+  for (uint32_t i : used_) {
+    slots_[i] = 0;
+  }
+  used_.clear();
+}
+
+void KmerHashSet::grow() {
+  vector<uint64_t> old(slots_.size() * 2, 0);
+  old.swap(slots_);
+  mask_ = slots_.size() - 1;
+  vector<uint32_t> used;
+  used.swap(used_);
+  for (uint32_t i : used) {
+    insert(old[i]);
+  }
+}
+
+}  // namespace rs
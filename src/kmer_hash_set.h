@@ -0,0 +1,44 @@
+// This is used for finding the first occurrence of every k-mer in a
+// sequence, e.g. a gene, without allocating a new set for every
+// sequence.
+
+#ifndef RS_KMER_HASH_SET_H
+#define RS_KMER_HASH_SET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using std::vector;
+
+namespace rs {
+
+// An open addressed set of the 64-bit hash values of the k-mers. Two
+// k-mers are taken as the same one only if their hash values are the
+// same, which is very unlikely for different k-mers.
+// The set is reused after clear, which only resets the slots used
+// since the last clear, so it costs O(size) instead of O(capacity), and
+// the memory is allocated only when the set grows.
+// This is NOT thread safe, and every thread should have its own set.
+class KmerHashSet {
+public:
+  KmerHashSet();
+
+  // Returns true if the hash value is not in the set before.
+  bool insert(uint64_t hashvalue);
+  void clear();
+  size_t size() const { return used_.size(); }
+
+private:
+  void grow();
+
+  // the empty slots are 0, and the hash value 0 is stored as 1
+  vector<uint64_t> slots_;
+  // the indexes of the used slots
+  vector<uint32_t> used_;
+  uint64_t mask_;
+};
+
+}  // namespace rs
+
+#endif  // RS_KMER_HASH_SET_H
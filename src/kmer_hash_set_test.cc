@@ -0,0 +1,29 @@
+#include "gtest/gtest.h"
+
+#include "kmer_hash_set.h"
+
+namespace rs {
+namespace {
+
+TEST(KmerHashSet, insert_and_clear) {
+  KmerHashSet set;
+  for (int round = 0; round < 3; round++) {
+    // the set grows in the first round, and is reused after
+    for (uint64_t i = 0; i < 10000; i++) {
+      ASSERT_TRUE(set.insert(i * 0x9e3779b97f4a7c15ULL));
+    }
+    ASSERT_EQ(10000, set.size());
+    for (uint64_t i = 0; i < 10000; i++) {
+      ASSERT_FALSE(set.insert(i * 0x9e3779b97f4a7c15ULL));
+    }
+    // two hash values in the same slot
+    ASSERT_TRUE(set.insert(1ULL << 40));
+    ASSERT_TRUE(set.insert(2ULL << 40));
+    ASSERT_FALSE(set.insert(1ULL << 40));
+    set.clear();
+    ASSERT_EQ(0, set.size());
+  }
+}
+
+}  // namespace
+}  // namespace rs
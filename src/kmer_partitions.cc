@@ -0,0 +1,126 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "glog/logging.h"
+
+#include "kmer_partitions.h"
+#include "rs_thread.h"
+
+namespace rs {
+
+KmerPartitions::KmerPartitions(int num_partitions, const string& dir) {
+  CHECK_GT(num_partitions, 0);
+  for (int i = 0; i < num_partitions; i++) {
+    Partition* p = new Partition();
+    p->file = nullptr;
+    if (!dir.empty()) {
+      p->filename = dir + "/kmers." + std::to_string(getpid()) + "." +
+          std::to_string(i);
+      p->file = fopen(p->filename.c_str(), "w+b");
+      PLOG_IF(FATAL, p->file == nullptr)
+        << "Failed to create file " << p->filename;
+    }
+    partitions_.push_back(p);
+  }
+}
+
+KmerPartitions::~KmerPartitions() {
+  for (auto p : partitions_) {
+    if (p->file != nullptr) {
+      fclose(p->file);
+      unlink(p->filename.c_str());
+    }
+    delete p;
+  }
+}
+
+void KmerPartitions::add(const vector<PackedKmer>& kmers) {
+  // the k-mers are grouped by the partitions first, so that every
+  // partition is locked once.
+  vector<vector<PackedKmer> > groups(partitions_.size());
+  for (auto& kmer : kmers) {
+    groups[index(kmer)].push_back(kmer);
+  }
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    if (groups[i].empty()) continue;
+    Partition* p = partitions_[i];
+    std::lock_guard<std::mutex> lock(p->m);
+    if (p->file == nullptr) {
+      p->kmers.insert(p->kmers.end(), groups[i].begin(), groups[i].end());
+    } else {
+      size_t n = fwrite(groups[i].data(), sizeof(PackedKmer),
+                        groups[i].size(), p->file);
+      PLOG_IF(FATAL, n != groups[i].size())
+        << "Failed to write file " << p->filename;
+    }
+  }
+}
+
+void KmerPartitions::find_shared(Partition* p) {
+  vector<PackedKmer> kmers;
+  kmers.swap(p->kmers);
+  if (p->file != nullptr) {
+    PLOG_IF(FATAL, fflush(p->file) != 0 || fseek(p->file, 0, SEEK_END) != 0)
+      << "Failed to write file " << p->filename;
+    kmers.resize(ftell(p->file) / sizeof(PackedKmer));
+    rewind(p->file);
+    size_t n = fread(kmers.data(), sizeof(PackedKmer), kmers.size(), p->file);
+    PLOG_IF(FATAL, n != kmers.size())
+      << "Failed to read file " << p->filename;
+    fclose(p->file);
+    unlink(p->filename.c_str());
+    p->file = nullptr;
+  }
+  std::sort(kmers.begin(), kmers.end());
+  // a k-mer is added once by every group
+  for (size_t i = 0; i < kmers.size();) {
+    size_t j = i + 1;
+    while (j < kmers.size() && kmers[j] == kmers[i]) j++;
+    if (j - i > 1) {
+      p->shared.push_back(kmers[i]);
+    }
+    i = j;
+  }
+  p->shared.shrink_to_fit();
+}
+
+void KmerPartitions::find_shared(int num_threads) {
+  std::atomic<size_t> next(0);
+  vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([this, &next] {
+        size_t i;
+        while ((i = next++) < partitions_.size()) {
+          find_shared(partitions_[i]);
+        }
+      });
+  }
+  barrier(threads);
+}
+
+bool KmerPartitions::shared(const PackedKmer& kmer) const {
+  const vector<PackedKmer>& shared = partitions_[index(kmer)]->shared;
+  return std::binary_search(shared.begin(), shared.end(), kmer);
+}
+
+void KmerPartitions::find_duplicates(const KmerCodec& codec,
+                                     const string& seq,
+                                     vector<bool>* dup) const {
+  dup->assign(seq.size(), true);
+  for_each_kmer(codec, seq, [this, dup](int start, const PackedKmer& kmer) {
+      (*dup)[start] = shared(kmer);
+    });
+}
+
+size_t KmerPartitions::num_shared() const {
+  size_t total = 0;
+  for (auto p : partitions_) {
+    total += p->shared.size();
+  }
+  return total;
+}
+
+}  // namespace rs
@@ -0,0 +1,98 @@
+// This is used for finding the k-mers shared by more than one group
+// (e.g. the genes) exactly, instead of with bloom filters which have
+// false positives.
+
+#ifndef RS_KMER_PARTITIONS_H
+#define RS_KMER_PARTITIONS_H
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "packed_kmer.h"
+
+using std::string;
+using std::vector;
+
+namespace rs {
+
+// Calls f(start, kmer) for every k-mer of seq without an invalid
+// nucleotide, where kmer is the smallest one of the k-mer, its reverse,
+// its complement and its reverse complement, the same orientations as
+// the ones hashed by CanonicalCyclicHash for the bloom filters.
+template <class F>
+void for_each_kmer(const KmerCodec& codec, const string& seq, F f) {
+  PackedKmer kmer = {0, 0}, rc = {0, 0};
+  int valid = 0;
+  for (size_t i = 0; i < seq.size(); i++) {
+    uint8_t code = nucleotide_code(seq[i]);
+    if (code == kInvalidNucleotide) {
+      valid = 0;
+      continue;
+    }
+    codec.push(&kmer, code);
+    codec.push_reverse_complement(&rc, code);
+    if (++valid < codec.k()) continue;
+    f(i + 1 - codec.k(),
+      std::min(std::min(kmer, rc),
+               std::min(codec.complement(kmer), codec.complement(rc))));
+  }
+}
+
+// The k-mers are partitioned by their hash values. The k-mers of a
+// partition are kept in memory, or appended to a file in a directory if
+// it is given, so that only the partitions being sorted need to be in
+// memory. After all the groups are added, the partitions are sorted by
+// find_shared in parallel, and only the k-mers in more than one group
+// are kept.
+class KmerPartitions {
+public:
+  // dir is the directory of the partition files, and the partitions
+  // are kept in memory if it is empty.
+  KmerPartitions(int num_partitions, const string& dir);
+  ~KmerPartitions();
+
+  // Adds the k-mers of one group, which must be distinct. This is
+  // thread safe.
+  void add(const vector<PackedKmer>& kmers);
+
+  // Finds the k-mers added by more than one group with num_threads
+  // threads. No group can be added after.
+  void find_shared(int num_threads);
+
+  // Whether the k-mer is added by more than one group. This is thread
+  // safe after find_shared.
+  bool shared(const PackedKmer& kmer) const;
+  size_t num_shared() const;
+  // Sets (*dup)[start] for every k-mer starting at start in the seq,
+  // which is false iff the k-mer is added by only one group. A k-mer
+  // with an invalid nucleotide is never added, so whether it is in
+  // more than one group is unknown, and it is taken as shared.
+  void find_duplicates(const KmerCodec& codec, const string& seq,
+                       vector<bool>* dup) const;
+
+private:
+  struct Partition {
+    std::mutex m;
+    // the k-mers of the partition in memory
+    vector<PackedKmer> kmers;
+    // the file of the partition, or nullptr if it is kept in memory
+    FILE* file;
+    string filename;
+    // the sorted k-mers in more than one group
+    vector<PackedKmer> shared;
+  };
+
+  size_t index(const PackedKmer& kmer) const {
+    return (hash_kmer(kmer) >> 32) % partitions_.size();
+  }
+  void find_shared(Partition* p);
+
+  vector<Partition*> partitions_;
+};
+
+}  // namespace rs
+
+#endif  // RS_KMER_PARTITIONS_H
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "rs_thread.h"
+
+#include "kmer_partitions.h"
+
+namespace rs {
+namespace {
+
+PackedKmer test_kmer(uint64_t i) {
+  PackedKmer kmer = {i % 5, i};
+  return kmer;
+}
+
+// The group g has the k-mers [g * 1000, g * 1000 + 1500), so the last
+// 500 k-mers of a group are shared with the next group.
+class AddThread : public ThreadInterface {
+public:
+  AddThread(KmerPartitions* partitions, int first_group, int num_groups)
+    : partitions_(partitions), first_group_(first_group),
+      num_groups_(num_groups) {}
+
+  void run() {
+    for (int g = first_group_; g < first_group_ + num_groups_; g++) {
+      vector<PackedKmer> kmers;
+      for (uint64_t i = g * 1000ULL; i < g * 1000ULL + 1500; i++) {
+        kmers.push_back(test_kmer(i));
+      }
+      partitions_->add(kmers);
+    }
+  }
+
+private:
+  KmerPartitions* partitions_;
+  int first_group_;
+  int num_groups_;
+};
+
+void test_partitions(const string& dir) {
+  const int num_threads = 4;
+  const int groups_per_thread = 25;
+  KmerPartitions partitions(16, dir);
+  vector<AddThread> add_threads;
+  for (int i = 0; i < num_threads; i++) {
+    add_threads.push_back(
+        AddThread(&partitions, i * groups_per_thread, groups_per_thread));
+  }
+  vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread(RSThread(&add_threads[i])));
+  }
+  barrier(threads);
+  partitions.find_shared(num_threads);
+
+  const uint64_t num_groups = num_threads * groups_per_thread;
+  ASSERT_EQ((num_groups - 1) * 500, partitions.num_shared());
+  for (uint64_t i = 0; i < num_groups * 1000 + 500; i++) {
+    bool shared = i >= 1000 && i % 1000 < 500 && i < num_groups * 1000;
+    ASSERT_EQ(shared, partitions.shared(test_kmer(i))) << i;
+  }
+}
+
+TEST(KmerPartitions, in_memory) {
+  test_partitions("");
+}
+
+TEST(KmerPartitions, in_files) {
+  test_partitions(".");
+}
+
+TEST(KmerPartitions, find_duplicates) {
+  KmerCodec codec(4);
+  // both genes have ACNTG and GTTTT
+  vector<string> genes = {"ACNTGTTTTC", "GGACNTGGTTTT"};
+  KmerPartitions partitions(4, "");
+  for (auto& gene : genes) {
+    vector<PackedKmer> kmers;
+    for_each_kmer(codec, gene, [&kmers](int, const PackedKmer& kmer) {
+        kmers.push_back(kmer);
+      });
+    std::sort(kmers.begin(), kmers.end());
+    kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+    partitions.add(kmers);
+  }
+  partitions.find_shared(1);
+  vector<bool> dup;
+  partitions.find_duplicates(codec, genes[0], &dup);
+  // the k-mers with N are taken as shared, and so are the last starts
+  // without a whole k-mer
+  vector<bool> expected = {true, true, true, false, true, true, false,
+                           true, true, true};
+  ASSERT_EQ(expected, dup);
+}
+
+}  // namespace
+}  // namespace rs
@@ -0,0 +1,88 @@
+#include "kmer_position_index.h"
+
+namespace rs {
+
+namespace {
+
+const size_t kInitialSlots = 1024;
+
+}  // namespace
+
+KmerPositionIndex::KmerPositionIndex()
+  : slots_(kInitialSlots, 0), mask_(kInitialSlots - 1) {}
+
+size_t KmerPositionIndex::slot(const PackedKmer& kmer) const {
+  size_t i = hash_kmer(kmer) & mask_;
+  while (slots_[i] != 0 && kmers_[slots_[i] - 1] != kmer) {
+    i = (i + 1) & mask_;
+  }
+  return i;
+}
+
+void KmerPositionIndex::add(const PackedKmer& kmer, int tidx, int position) {
+  // at most half of the slots are used
+  if ((kmers_.size() + 1) * 2 > slots_.size()) {
+    grow();
+  }
+  size_t i = slot(kmer);
+  if (slots_[i] == 0) {
+    kmers_.push_back(kmer);
+    slots_[i] = kmers_.size();
+    used_.push_back(i);
+  }
+  ids_.push_back(slots_[i] - 1);
+  added_.push_back(std::make_pair(tidx, position));
+}
+
+void KmerPositionIndex::build() {
+  offsets_.assign(kmers_.size() + 1, 0);
+  for (uint32_t id : ids_) {
+    offsets_[id + 1] ++;
+  }
+  for (size_t i = 0; i < kmers_.size(); i++) {
+    offsets_[i + 1] += offsets_[i];
+  }
+  positions_.resize(added_.size());
+  // offsets_[id] is moved to the end of the positions of id while they
+  // are filled, and then moved back
+  for (size_t i = 0; i < ids_.size(); i++) {
+    positions_[offsets_[ids_[i]] ++] = added_[i];
+  }
+  for (size_t i = kmers_.size(); i > 0; i--) {
+    offsets_[i] = offsets_[i - 1];
+  }
+  offsets_[0] = 0;
+}
+
+const pair<int, int>* KmerPositionIndex::find(const PackedKmer& kmer,
+                                              size_t* size) const {
+  size_t i = slot(kmer);
+  if (slots_[i] == 0) return nullptr;
+  uint32_t id = slots_[i] - 1;
+  *size = offsets_[id + 1] - offsets_[id];
+  return &positions_[offsets_[id]];
+}
+
+void KmerPositionIndex::clear() {
+  for (size_t i : used_) {
+    slots_[i] = 0;
+  }
+  used_.clear();
+  kmers_.clear();
+  ids_.clear();
+  added_.clear();
+}
+
+void KmerPositionIndex::grow() {
+  vector<uint32_t> old(slots_.size() * 2, 0);
+  old.swap(slots_);
+  mask_ = slots_.size() - 1;
+  used_.clear();
+  for (size_t id = 0; id < kmers_.size(); id++) {
+    size_t i = slot(kmers_[id]);
+    slots_[i] = id + 1;
+    used_.push_back(i);
+  }
+}
+
+}  // namespace rs
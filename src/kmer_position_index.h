@@ -0,0 +1,61 @@
+// This is used for finding the positions of the k-mers in the sig-mer
+// regions of a gene without keeping every k-mer as a string.
+
+#ifndef RS_KMER_POSITION_INDEX_H
+#define RS_KMER_POSITION_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "packed_kmer.h"
+
+using std::pair;
+using std::vector;
+
+namespace rs {
+
+// The positions (transcript index, position) of the packed k-mers, in
+// a flat open addressed hash table. The k-mers are added one by one,
+// and build groups the positions of every k-mer in one array, in the
+// order they are added.
+// The index is reused after clear, which only resets the slots used
+// since the last clear, like KmerHashSet.
+// This is NOT thread safe, and every thread should have its own index.
+class KmerPositionIndex {
+public:
+  KmerPositionIndex();
+
+  void add(const PackedKmer& kmer, int tidx, int position);
+  // This must be called after all the k-mers are added, and before find.
+  void build();
+  // Returns the positions of the k-mer, and sets the number of them.
+  // Returns nullptr if the k-mer is not added.
+  const pair<int, int>* find(const PackedKmer& kmer, size_t* size) const;
+  void clear();
+
+private:
+  // Returns the slot of the k-mer, which is empty if it is not added.
+  size_t slot(const PackedKmer& kmer) const;
+  void grow();
+
+  // the ids of the k-mers plus one, and 0 is empty
+  vector<uint32_t> slots_;
+  // the indexes of the used slots
+  vector<size_t> used_;
+  uint64_t mask_;
+  // the k-mer of every id
+  vector<PackedKmer> kmers_;
+  // the id and the position of every k-mer added
+  vector<uint32_t> ids_;
+  vector<pair<int, int> > added_;
+  // the positions of the k-mer with id i are in
+  // [offsets_[i], offsets_[i + 1]) of positions_
+  vector<uint32_t> offsets_;
+  vector<pair<int, int> > positions_;
+};
+
+}  // namespace rs
+
+#endif  // RS_KMER_POSITION_INDEX_H
@@ -0,0 +1,40 @@
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "kmer_position_index.h"
+
+namespace rs {
+namespace {
+
+TEST(KmerPositionIndex, find) {
+  KmerPositionIndex index;
+  for (int round = 0; round < 3; round++) {
+    // the index grows in the first round, and is reused after
+    std::map<uint64_t, vector<pair<int, int> > > expected;
+    for (int i = 0; i < 20000; i++) {
+      PackedKmer kmer = {static_cast<uint64_t>(round), (i * 7919ULL) % 5000};
+      index.add(kmer, i % 3, i);
+      expected[kmer.lo].push_back(std::make_pair(i % 3, i));
+    }
+    index.build();
+    for (auto& item : expected) {
+      PackedKmer kmer = {static_cast<uint64_t>(round), item.first};
+      size_t size = 0;
+      const pair<int, int>* positions = index.find(kmer, &size);
+      ASSERT_TRUE(positions != nullptr);
+      // the positions are in the order they are added
+      vector<pair<int, int> > found(positions, positions + size);
+      ASSERT_EQ(item.second, found);
+    }
+    PackedKmer missing = {static_cast<uint64_t>(round + 1), 0};
+    size_t size;
+    ASSERT_TRUE(index.find(missing, &size) == nullptr);
+    index.clear();
+  }
+}
+
+}  // namespace
+}  // namespace rs
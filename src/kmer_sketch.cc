@@ -0,0 +1,49 @@
+#include <algorithm>
+#include <limits>
+
+#include "kmer_sketch.h"
+
+namespace rs {
+
+KmerSketch::KmerSketch(size_t size)
+  : size_(size), max_(std::numeric_limits<uint64_t>::max()) {}
+
+void KmerSketch::add(uint64_t hashvalue) {
+  if (hashvalue > max_) return;
+  hashes_.push_back(hashvalue);
+  // trim the duplicated and the large hash values from time to time, so
+  // the sketch uses O(size) memory
+  if (hashes_.size() >= size_ * 2) {
+    trim();
+  }
+}
+
+void KmerSketch::finish() {
+  trim();
+  hashes_.shrink_to_fit();
+}
+
+void KmerSketch::trim() {
+  std::sort(hashes_.begin(), hashes_.end());
+  hashes_.erase(std::unique(hashes_.begin(), hashes_.end()), hashes_.end());
+  if (hashes_.size() >= size_) {
+    hashes_.resize(size_);
+    max_ = hashes_.back();
+  }
+}
+
+void KmerSketch::containment(const KmerSketch& other, int* dup,
+                             int* total) const {
+  *dup = *total = 0;
+  size_t j = 0;
+  for (uint64_t hashvalue : hashes_) {
+    if (hashvalue > other.max_) break;
+    while (j < other.hashes_.size() && other.hashes_[j] < hashvalue) j++;
+    if (j < other.hashes_.size() && other.hashes_[j] == hashvalue) {
+      (*dup) ++;
+    }
+    (*total) ++;
+  }
+}
+
+}  // namespace rs
@@ -0,0 +1,52 @@
+// This is a bottom-k MinHash sketch of the k-mers of a gene, which is
+// used for estimating how much of a gene is in another one without
+// keeping all their k-mers.
+
+#ifndef RS_KMER_SKETCH_H
+#define RS_KMER_SKETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using std::vector;
+
+namespace rs {
+
+// The sketch keeps the size smallest distinct hash values of the
+// k-mers, which are added one by one in a single pass over the
+// sequences. The hash values must be uniformly distributed (e.g. the
+// ones of CanonicalCyclicHash).
+class KmerSketch {
+public:
+  explicit KmerSketch(size_t size);
+
+  void add(uint64_t hashvalue);
+  // This must be called after all the hash values are added, and
+  // before the sketch is used.
+  void finish();
+
+  // the hash values in the ascending order
+  const vector<uint64_t>& hashes() const { return hashes_; }
+
+  // Estimates the fraction of the k-mers of this sketch which are also
+  // in the other one: total is the number of the hash values of this
+  // sketch no larger than the largest one of the other sketch (all of
+  // them if the other sketch is not full), and dup is the number of
+  // them in the other sketch, which is exact since the other sketch
+  // keeps all its hash values up to its largest one.
+  void containment(const KmerSketch& other, int* dup, int* total) const;
+
+private:
+  // Keeps the size_ smallest distinct hash values.
+  void trim();
+
+  size_t size_;
+  vector<uint64_t> hashes_;
+  // the hash values larger than this are not in the sketch
+  uint64_t max_;
+};
+
+}  // namespace rs
+
+#endif  // RS_KMER_SKETCH_H
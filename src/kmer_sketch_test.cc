@@ -0,0 +1,67 @@
+#include <algorithm>
+
+#include "gtest/gtest.h"
+
+#include "kmer_sketch.h"
+
+namespace rs {
+namespace {
+
+uint64_t hash_of(uint64_t i) {
+  return i * 0x9e3779b97f4a7c15ULL;
+}
+
+TEST(KmerSketch, smallest_hashes) {
+  KmerSketch sketch(100);
+  vector<uint64_t> expected;
+  for (uint64_t i = 0; i < 10000; i++) {
+    sketch.add(hash_of(i));
+    // the duplicated hash values are kept once
+    sketch.add(hash_of(i));
+    expected.push_back(hash_of(i));
+  }
+  sketch.finish();
+  std::sort(expected.begin(), expected.end());
+  expected.resize(100);
+  ASSERT_EQ(expected, sketch.hashes());
+}
+
+TEST(KmerSketch, containment) {
+  // a is in b, and c shares half of a
+  KmerSketch a(200), b(200), c(200);
+  for (uint64_t i = 0; i < 5000; i++) {
+    a.add(hash_of(i));
+    c.add(hash_of(i % 2 == 0 ? i : i + 1000000));
+  }
+  for (uint64_t i = 0; i < 20000; i++) {
+    b.add(hash_of(i));
+  }
+  a.finish(), b.finish(), c.finish();
+  int dup, total;
+  a.containment(b, &dup, &total);
+  ASSERT_GT(total, 0);
+  ASSERT_EQ(dup, total);
+  a.containment(c, &dup, &total);
+  ASSERT_NEAR(0.5, dup * 1.0 / total, 0.15);
+  // only a quarter of b is in a
+  b.containment(a, &dup, &total);
+  ASSERT_NEAR(0.25, dup * 1.0 / total, 0.1);
+}
+
+TEST(KmerSketch, small_sets) {
+  // the sketches keep all the hash values of the small sets
+  KmerSketch a(100), b(100);
+  for (uint64_t i = 0; i < 10; i++) {
+    a.add(hash_of(i));
+    b.add(hash_of(i + 5));
+  }
+  a.finish(), b.finish();
+  ASSERT_EQ(10, a.hashes().size());
+  int dup, total;
+  a.containment(b, &dup, &total);
+  ASSERT_EQ(5, dup);
+  ASSERT_EQ(10, total);
+}
+
+}  // namespace
+}  // namespace rs
@@ -17,7 +17,7 @@ static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
 static int flush_dirty_pages(bloom_bitmap *map);
 static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
 extern inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx);
-extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
+extern inline int bitmap_setbit(bloom_bitmap *map, uint64_t idx);
 
 /**
  * Returns a bloom_bitmap pointer from a file handle
@@ -65,31 +65,40 @@ int bitmap_close(bloom_bitmap *map);
 
 /**
  * Returns the value of the bit at index idx for the
- * bloom_bitmap map
+ * bloom_bitmap map. The bits set before the bit (and a
+ * release fence) by another thread are visible after it.
  */
 inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx) {
-    return (map->mmap[idx >> 3] >> (7 - (idx % 8))) & 0x1;
+    unsigned char byte = __atomic_load_n(&map->mmap[idx >> 3], __ATOMIC_ACQUIRE);
+    return (byte >> (7 - (idx % 8))) & 0x1;
 }
 
 /*
  * Used to set a bit in the bitmap, and as a side affect,
- * mark the page as dirty if we are in the PERSISTENT mode
+ * mark the page as dirty if we are in the PERSISTENT mode.
+ * The bit is set by an atomic fetch-or of the 64-bit word holding it,
+ * so this is safe for concurrent use, and no bit set by another thread
+ * is lost. The layout of the bits is the same as setting them by byte.
+ * @returns the value of the bit before it is set.
  */
-inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx) {
-    unsigned char byte = map->mmap[idx >> 3];
-    unsigned char byte_off = 7 - idx % 8;
-    byte |= 1 << byte_off;
-    map->mmap[idx >> 3] = byte;
+inline int bitmap_setbit(bloom_bitmap *map, uint64_t idx) {
+    uint64_t *word = (uint64_t*)map->mmap + (idx >> 6);
+    uint64_t byte_in_word = (idx >> 3) & 7;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    byte_in_word = 7 - byte_in_word;
+#endif
+    uint64_t mask = 1ULL << (byte_in_word * 8 + 7 - idx % 8);
+    uint64_t old = __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
 
     // Check if we need to dirty the page
     if (map->mode == PERSISTENT) {
         // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
         uint64_t page = idx >> 15;
-        byte = map->dirty_pages[page >> 3];
-        byte_off = 7 - page % 8;
-        byte |= 1 << byte_off;
-        map->dirty_pages[page >> 3] = byte;
+        unsigned char byte_off = 7 - page % 8;
+        __atomic_fetch_or(&map->dirty_pages[page >> 3],
+                          (unsigned char)(1 << byte_off), __ATOMIC_RELAXED);
     }
+    return (old & mask) != 0;
 }
 
 #endif
@@ -15,6 +15,7 @@ extern void SpookyHash128(const void *key, size_t len, uint64_t seed1, uint64_t
         uint64_t *hash1, uint64_t *hash2);
 
 void bf_internal_compute_hashes(uint32_t k_num, const char *key, uint64_t len, uint64_t *hashes);
+static void bf_internal_hashes_from_hash(uint32_t k_num, uint64_t hash, uint64_t *hashes);
 
 /**
  * Creates a new bloom filter using a given bitmap and k-value.
@@ -98,6 +99,54 @@ static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
 }
 
 
+/**
+ * Internal bf_add method.
+ * The first bit of the key that is not set is the owner of the key, and
+ * it is set after the other bits. Only the thread that sets the owner
+ * reports the key as new, so at most one of the threads adding the same
+ * new key at the same time reports it as new. If another key sets the
+ * owner in between, none of them does.
+ * @arg filter The filter to add to
+ * @arg hashes Contains at least K num hashes
+ * @returns 1 if the key was added, 0 if present.
+ */
+static int bf_internal_add(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint64_t m = filter->offset;
+    uint64_t offset;
+    uint64_t h;
+    uint32_t i;
+    uint64_t bit;
+    uint64_t owner_bit = 0;
+    uint32_t owner;
+
+    // Find the owner, or the key is already present
+    for (owner=0; owner< filter->header->k_num; owner++) {
+        h = hashes[owner];                                  // Get the hash value
+        offset = 8*sizeof(bloom_filter_header) + owner * m; // Get the partition offset
+        owner_bit = offset + (h % m);                       // Compute the bit offset
+        if (bitmap_getbit(filter->map, owner_bit) == 0) break;
+    }
+    if (owner == filter->header->k_num) {
+        return 0;  // Key already present, do not add.
+    }
+
+    // The bits before the owner are set already
+    for (i=owner+1; i< filter->header->k_num; i++) {
+        h = hashes[i];                                  // Get the hash value
+        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
+        bit = offset + (h % m);                         // Compute the bit offset
+        bitmap_setbit(filter->map, bit);
+    }
+
+    // A thread that finds the owner set also finds the other bits set
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (bitmap_setbit(filter->map, owner_bit)) {
+        return 0;  // Another thread added the key.
+    }
+    __atomic_fetch_add(&filter->header->count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
 /**
  * Adds a new key to the bloom filter.
  * @arg filter The filter to add to
@@ -115,28 +164,16 @@ int bf_add(bloom_bloomfilter *filter, const char* key, uint64_t len) {
 
     // Compute the hashes
     bf_internal_compute_hashes(filter->header->k_num, key, len, hashes);
+    return bf_internal_add(filter, hashes);
+}
 
-    // Check if the item exists
-    int res = bf_internal_contains(filter, hashes);
-    if (res == 1) {
-        return 0;  // Key already present, do not add.
-    }
-
-    uint64_t m = filter->offset;
-    uint64_t offset;
-    uint64_t h;
-    uint32_t i;
-    uint64_t bit;
-
-    for (i=0; i< filter->header->k_num; i++) {
-        h = hashes[i];                                  // Get the hash value
-        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
-        bit = offset + (h % m);                         // Compute the bit offset
-        bitmap_setbit(filter->map, bit);
-    }
+int bf_add_hash(bloom_bloomfilter *filter, uint64_t hash) {
+    // Allocate the hash space
+    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
 
-    filter->header->count += 1;
-    return 1;
+    // Derive the hashes
+    bf_internal_hashes_from_hash(filter->header->k_num, hash, hashes);
+    return bf_internal_add(filter, hashes);
 }
 
 /**
@@ -161,6 +198,15 @@ int bf_contains(bloom_bloomfilter *filter, const char* key, uint64_t len) {
     return bf_internal_contains(filter, hashes);
 }
 
+int bf_contains_hash(bloom_bloomfilter *filter, uint64_t hash) {
+    // Allocate the hash space
+    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+
+    // Derive the hashes
+    bf_internal_hashes_from_hash(filter->header->k_num, hash, hashes);
+    return bf_internal_contains(filter, hashes);
+}
+
 /**
  * Returns the size of the bloom filter in item count
  */
@@ -342,3 +388,19 @@ void bf_internal_compute_hashes(uint32_t k_num, const char *key, uint64_t len, u
         hashes[i] = hashes[1] + ((i * hashes[3]) % 18446744073709551557U);
     }
 }
+
+// Derives k_num hashes from one 64-bit hash
+static void bf_internal_hashes_from_hash(uint32_t k_num, uint64_t hash, uint64_t *hashes) {
+    // The second hash is the hash value mixed again (by the finalizer of
+    // MurmurHash3), and the hashes are combined as in
+    // bf_internal_compute_hashes: g_i(x) = h1(u) + i * h2(u)
+    uint64_t h2 = hash ^ 0x9e3779b97f4a7c15ULL;
+    h2 ^= h2 >> 33;
+    h2 *= 0xff51afd7ed558ccdULL;
+    h2 ^= h2 >> 33;
+    h2 *= 0xc4ceb9fe1a85ec53ULL;
+    h2 ^= h2 >> 33;
+    for (uint32_t i=0; i < k_num; i++) {
+        hashes[i] = hash + i * h2;
+    }
+}
@@ -58,6 +58,17 @@ int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloo
 int bf_add(bloom_bloomfilter *filter, char* key);
 int bf_add(bloom_bloomfilter *filter, const char* key, uint64_t len);
 
+/**
+ * Adds a new key to the bloom filter by a well mixed 64-bit hash value
+ * of the key, which is computed by the caller (e.g. a rolling hash).
+ * The k hashes are derived from it, so a filter should only be used
+ * with either the keys or the hash values.
+ * @arg filter The filter to add to
+ * @arg hash The hash value of the key
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int bf_add_hash(bloom_bloomfilter *filter, uint64_t hash);
+
 /**
  * Checks the filter for a key
  * @arg filter The filter to check
@@ -67,6 +78,14 @@ int bf_add(bloom_bloomfilter *filter, const char* key, uint64_t len);
 int bf_contains(bloom_bloomfilter *filter, char* key);
 int bf_contains(bloom_bloomfilter *filter, const char* key, uint64_t len);
 
+/**
+ * Checks the filter for a key by its hash value, see bf_add_hash.
+ * @arg filter The filter to check
+ * @arg hash The hash value of the key
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_hash(bloom_bloomfilter *filter, uint64_t hash);
+
 /**
  * Returns the size of the bloom filter in item count
  */
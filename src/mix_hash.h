@@ -0,0 +1,24 @@
+// This is the finalizer of MurmurHash3, which is shared by the hash
+// values that are derived from another 64-bit value.
+
+#ifndef RS_MIX_HASH_H
+#define RS_MIX_HASH_H
+
+#include <cstdint>
+
+namespace rs {
+
+// Every bit of the result depends on all the bits of h, and different
+// values of h give different results.
+inline uint64_t mix_hash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+}  // namespace rs
+
+#endif  // RS_MIX_HASH_H
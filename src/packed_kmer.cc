@@ -0,0 +1,200 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RS_X86_SIMD
+#endif
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+#include "packed_kmer.h"
+
+namespace rs {
+
+namespace {
+
+const char kCodeToNucleotide[4] = {'A', 'C', 'G', 'T'};
+
+// Encodes seq[begin, size) one word of invalid at a time, where begin
+// is a multiple of 64.
+void encode_scalar(const char* seq, size_t begin, size_t size,
+                   uint8_t* codes, uint64_t* invalid) {
+  for (size_t start = begin; start < size; start += 64) {
+    size_t end = std::min(start + 64, size);
+    uint64_t bits = 0;
+    for (size_t i = start; i < end; i++) {
+      uint8_t code = nucleotide_code(seq[i]);
+      codes[i] = code;
+      bits |= static_cast<uint64_t>(code == kInvalidNucleotide) << (i - start);
+    }
+    invalid[start / 64] = bits;
+  }
+}
+
+// The vectorized kernels encode the first (size / 64 * 64) characters,
+// and return the number of the encoded characters.
+typedef size_t (*EncodeKernel)(const char* seq, size_t size, uint8_t* codes,
+                               uint64_t* invalid);
+
+#ifdef RS_X86_SIMD
+// The low four bits of A, C, G and T (and a, c, g and t) are 1, 3, 7
+// and 4, which are looked up (pshufb) for their codes. A character is
+// valid iff it is one of them after clearing the lower case bit.
+#define RS_NUCLEOTIDE_LOOKUP 4, 0, 4, 1, 3, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4
+
+__attribute__((target("avx2")))
+size_t encode_avx2(const char* seq, size_t size, uint8_t* codes,
+                   uint64_t* invalid) {
+  const __m256i lookup = _mm256_setr_epi8(RS_NUCLEOTIDE_LOOKUP,
+                                          RS_NUCLEOTIDE_LOOKUP);
+  const __m256i low_bits = _mm256_set1_epi8(0x0f);
+  const __m256i upper_case = _mm256_set1_epi8(static_cast<char>(0xdf));
+  const __m256i a = _mm256_set1_epi8('A'), c = _mm256_set1_epi8('C');
+  const __m256i g = _mm256_set1_epi8('G'), t = _mm256_set1_epi8('T');
+  const __m256i invalid_code = _mm256_set1_epi8(kInvalidNucleotide);
+  size_t end = size / 64 * 64;
+  for (size_t start = 0; start < end; start += 64) {
+    uint64_t bits = 0;
+    for (int half = 0; half < 2; half++) {
+      size_t i = start + half * 32;
+      __m256i chars = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(seq + i));
+      __m256i upper = _mm256_and_si256(chars, upper_case);
+      __m256i valid = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(upper, a),
+                          _mm256_cmpeq_epi8(upper, c)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(upper, g),
+                          _mm256_cmpeq_epi8(upper, t)));
+      __m256i code = _mm256_shuffle_epi8(
+          lookup, _mm256_and_si256(chars, low_bits));
+      code = _mm256_blendv_epi8(invalid_code, code, valid);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(codes + i), code);
+      uint32_t valid_bits = _mm256_movemask_epi8(valid);
+      bits |= static_cast<uint64_t>(~valid_bits) << (half * 32);
+    }
+    invalid[start / 64] = bits;
+  }
+  return end;
+}
+
+__attribute__((target("sse4.2")))
+size_t encode_sse42(const char* seq, size_t size, uint8_t* codes,
+                    uint64_t* invalid) {
+  const __m128i lookup = _mm_setr_epi8(RS_NUCLEOTIDE_LOOKUP);
+  const __m128i low_bits = _mm_set1_epi8(0x0f);
+  const __m128i upper_case = _mm_set1_epi8(static_cast<char>(0xdf));
+  const __m128i a = _mm_set1_epi8('A'), c = _mm_set1_epi8('C');
+  const __m128i g = _mm_set1_epi8('G'), t = _mm_set1_epi8('T');
+  const __m128i invalid_code = _mm_set1_epi8(kInvalidNucleotide);
+  size_t end = size / 64 * 64;
+  for (size_t start = 0; start < end; start += 64) {
+    uint64_t bits = 0;
+    for (int quarter = 0; quarter < 4; quarter++) {
+      size_t i = start + quarter * 16;
+      __m128i chars = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(seq + i));
+      __m128i upper = _mm_and_si128(chars, upper_case);
+      __m128i valid = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(upper, a), _mm_cmpeq_epi8(upper, c)),
+          _mm_or_si128(_mm_cmpeq_epi8(upper, g), _mm_cmpeq_epi8(upper, t)));
+      __m128i code = _mm_shuffle_epi8(lookup,
+                                      _mm_and_si128(chars, low_bits));
+      code = _mm_blendv_epi8(invalid_code, code, valid);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(codes + i), code);
+      uint64_t valid_bits = _mm_movemask_epi8(valid);
+      bits |= (~valid_bits & 0xffff) << (quarter * 16);
+    }
+    invalid[start / 64] = bits;
+  }
+  return end;
+}
+
+#undef RS_NUCLEOTIDE_LOOKUP
+#endif  // RS_X86_SIMD
+
+EncodeKernel choose_kernel() {
+#ifdef RS_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return encode_avx2;
+  if (__builtin_cpu_supports("sse4.2")) return encode_sse42;
+#endif
+  return nullptr;
+}
+
+}  // namespace
+
+// This is a constant table so that it can be used before main.
+const uint8_t kNucleotideCode[256] = {
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+};
+
+void encode_nucleotides(const char* seq, size_t size, uint8_t* codes,
+                        uint64_t* invalid) {
+  static const EncodeKernel kernel = choose_kernel();
+  size_t begin = kernel == nullptr ? 0 : kernel(seq, size, codes, invalid);
+  encode_scalar(seq, begin, size, codes, invalid);
+}
+
+void encode_nucleotides_scalar(const char* seq, size_t size, uint8_t* codes,
+                               uint64_t* invalid) {
+  encode_scalar(seq, 0, size, codes, invalid);
+}
+
+KmerCodec::KmerCodec(int k) : k_(k) {
+  LOG_IF(FATAL, k <= 0 || k > 64)
+    << "The k-mer length must be in [1, 64], k=" << k;
+  lo_mask_ = k >= 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+  hi_mask_ = k <= 32 ? 0 : (k == 64 ? ~0ULL : (1ULL << (2 * k - 64)) - 1);
+  top_in_hi_ = k > 32;
+  top_shift_ = top_in_hi_ ? 2 * (k - 1) - 64 : 2 * (k - 1);
+}
+
+bool KmerCodec::encode(const StringPiece& key, PackedKmer* kmer) const {
+  if (key.size() != k_) return false;
+  kmer->hi = kmer->lo = 0;
+  for (int i = 0; i < key.size(); i++) {
+    uint8_t code = nucleotide_code(key[i]);
+    if (code == kInvalidNucleotide) return false;
+    push(kmer, code);
+  }
+  return true;
+}
+
+string KmerCodec::decode(const PackedKmer& kmer) const {
+  string key(k_, 'A');
+  uint64_t hi = kmer.hi, lo = kmer.lo;
+  for (int i = k_ - 1; i >= 0; i--) {
+    key[i] = kCodeToNucleotide[lo & 3];
+    lo = (lo >> 2) | (hi << 62);
+    hi >>= 2;
+  }
+  return key;
+}
+
+PackedKmer KmerCodec::reverse_complement(const PackedKmer& kmer) const {
+  PackedKmer rc = {0, 0};
+  uint64_t hi = kmer.hi, lo = kmer.lo;
+  for (int i = 0; i < k_; i++) {
+    push(&rc, 3 - (lo & 3));
+    lo = (lo >> 2) | (hi << 62);
+    hi >>= 2;
+  }
+  return rc;
+}
+
+}  // namespace rs
@@ -0,0 +1,139 @@
+// This is used for storing a k-mer in two 64-bit words (two bits per
+// nucleotide) instead of a string, so that comparing two k-mers only
+// needs one or two integer comparisons.
+
+#ifndef RS_PACKED_KMER_H
+#define RS_PACKED_KMER_H
+
+#include <cstdint>
+#include <string>
+
+#include "mix_hash.h"
+#include "stringpiece.h"
+
+using std::string;
+
+namespace rs {
+
+// The last nucleotide of the k-mer is stored in the lowest two bits of
+// lo, and the nucleotides before the last 32 ones are stored in hi.
+// The unused bits are always zero.
+struct PackedKmer {
+  uint64_t hi;
+  uint64_t lo;
+
+  bool operator==(const PackedKmer& other) const {
+    return lo == other.lo && hi == other.hi;
+  }
+  bool operator!=(const PackedKmer& other) const {
+    return !(*this == other);
+  }
+  bool operator<(const PackedKmer& other) const {
+    return hi < other.hi || (hi == other.hi && lo < other.lo);
+  }
+};
+
+// A = 0, C = 1, G = 2, T = 3, and the same for the lower case (soft
+// masked) letters. Every other character (e.g. 'N' and the other IUPAC
+// codes) is mapped to kInvalidNucleotide, and cannot be part of a
+// packed k-mer.
+const uint8_t kInvalidNucleotide = 4;
+extern const uint8_t kNucleotideCode[256];
+
+inline uint8_t nucleotide_code(char c) {
+  return kNucleotideCode[static_cast<uint8_t>(c)];
+}
+
+// Encodes the characters of seq into codes (codes[i] is
+// nucleotide_code(seq[i])) in one sweep, and sets the ith bit of
+// invalid (bit i % 64 of invalid[i / 64]) iff codes[i] is
+// kInvalidNucleotide. invalid must have (size + 63) / 64 words.
+// This uses AVX2 or SSE4.2 if the CPU supports them.
+void encode_nucleotides(const char* seq, size_t size, uint8_t* codes,
+                        uint64_t* invalid);
+
+// The scalar version of encode_nucleotides, for testing.
+void encode_nucleotides_scalar(const char* seq, size_t size, uint8_t* codes,
+                               uint64_t* invalid);
+
+// Returns the first position in [start, size) whose bit is set in
+// invalid, or size if there is none.
+inline size_t next_invalid(const uint64_t* invalid, size_t start,
+                           size_t size) {
+  size_t word = start / 64;
+  uint64_t bits = invalid[word] & (~0ULL << (start % 64));
+  while (bits == 0) {
+    if (++word * 64 >= size) return size;
+    bits = invalid[word];
+  }
+  size_t pos = word * 64 + __builtin_ctzll(bits);
+  return pos < size ? pos : size;
+}
+
+// A well mixed 64-bit hash value of the k-mer, so that a k-mer does
+// not need to be hashed from its characters.
+inline uint64_t hash_kmer(const PackedKmer& kmer) {
+  return mix_hash(kmer.lo ^ (kmer.hi * 0x9e3779b97f4a7c15ULL));
+}
+
+// Converts k-mers between strings and PackedKmer. k must be no more
+// than 64.
+class KmerCodec {
+ public:
+  explicit KmerCodec(int k);
+
+  int k() const { return k_; }
+
+  // return false if the key is not of length k or it contains a
+  // character other than A, C, G and T.
+  bool encode(const StringPiece& key, PackedKmer* kmer) const;
+  string decode(const PackedKmer& kmer) const;
+
+  PackedKmer reverse_complement(const PackedKmer& kmer) const;
+
+  // The complement of every nucleotide, without reversing the k-mer.
+  PackedKmer complement(const PackedKmer& kmer) const {
+    PackedKmer result = {kmer.hi ^ hi_mask_, kmer.lo ^ lo_mask_};
+    return result;
+  }
+
+  // The smaller one of the k-mer and its reverse complement, which is
+  // the same for both strands of a sequence.
+  PackedKmer canonical(const PackedKmer& kmer) const {
+    PackedKmer rc = reverse_complement(kmer);
+    return rc < kmer ? rc : kmer;
+  }
+
+  // Appends the nucleotide code at the end of the k-mer, and drops the
+  // first nucleotide. The code must be valid.
+  void push(PackedKmer* kmer, uint8_t code) const {
+    kmer->hi = ((kmer->hi << 2) | (kmer->lo >> 62)) & hi_mask_;
+    kmer->lo = ((kmer->lo << 2) | code) & lo_mask_;
+  }
+
+  // The counterpart of push for the reverse complement of the k-mer:
+  // if rc is the reverse complement of kmer before push(kmer, code),
+  // it is still the reverse complement after the call.
+  void push_reverse_complement(PackedKmer* rc, uint8_t code) const {
+    rc->lo = (rc->lo >> 2) | (rc->hi << 62);
+    rc->hi >>= 2;
+    uint64_t complement = 3 - code;
+    if (top_in_hi_) {
+      rc->hi |= complement << top_shift_;
+    } else {
+      rc->lo |= complement << top_shift_;
+    }
+  }
+
+ private:
+  int k_;
+  uint64_t hi_mask_;
+  uint64_t lo_mask_;
+  // where the first nucleotide of a k-mer is stored
+  bool top_in_hi_;
+  int top_shift_;
+};
+
+}  // namespace rs
+
+#endif  // RS_PACKED_KMER_H
@@ -0,0 +1,133 @@
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "packed_kmer.h"
+
+using std::string;
+namespace rs {
+namespace {
+
+TEST(KmerCodec, encode_and_decode) {
+  string keys[] = {"A", "ACGT", "TTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAAC",
+                   "ACGTACGTACGTACGTACGTACGTACGTACGT",
+                   "ACGTACGTACGTACGTACGTACGTACGTACGTA",
+                   "TTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTTT"};
+  for (const string& key : keys) {
+    KmerCodec codec(key.size());
+    PackedKmer kmer;
+    ASSERT_TRUE(codec.encode(key, &kmer));
+    ASSERT_EQ(key, codec.decode(kmer));
+  }
+}
+
+TEST(KmerCodec, invalid_key) {
+  KmerCodec codec(4);
+  PackedKmer kmer;
+  ASSERT_FALSE(codec.encode("ACNT", &kmer));
+  ASSERT_FALSE(codec.encode("ACG", &kmer));
+  ASSERT_FALSE(codec.encode("ACGTA", &kmer));
+  ASSERT_FALSE(codec.encode("ACRT", &kmer));
+}
+
+TEST(KmerCodec, lower_case) {
+  KmerCodec codec(4);
+  PackedKmer upper, lower;
+  ASSERT_TRUE(codec.encode("ACGT", &upper));
+  ASSERT_TRUE(codec.encode("acgT", &lower));
+  ASSERT_EQ(upper, lower);
+}
+
+TEST(EncodeNucleotides, same_as_scalar) {
+  string alphabet = "ACGTacgtNnRYKMSWBDHV-.*\r\x80\xff\xc1\xe1";
+  unsigned int seed = 1;
+  for (size_t size = 0; size < 300; size++) {
+    string seq;
+    for (size_t i = 0; i < size; i++) {
+      seed = seed * 1103515245 + 12345;
+      // mostly nucleotides, sometimes a run of invalid characters
+      int c = (seed >> 16) % 64;
+      seq.push_back(c < 56 ? alphabet[c % 8] : alphabet[c % alphabet.size()]);
+    }
+    size_t words = (size + 63) / 64;
+    std::vector<uint8_t> codes(size), expected_codes(size);
+    std::vector<uint64_t> invalid(words), expected_invalid(words);
+    encode_nucleotides(seq.data(), size, codes.data(), invalid.data());
+    encode_nucleotides_scalar(seq.data(), size, expected_codes.data(),
+                              expected_invalid.data());
+    ASSERT_EQ(expected_codes, codes);
+    ASSERT_EQ(expected_invalid, invalid);
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(nucleotide_code(seq[i]), codes[i]);
+      size_t next = i;
+      while (next < size && codes[next] != kInvalidNucleotide) next++;
+      ASSERT_EQ(next, next_invalid(invalid.data(), i, size));
+    }
+  }
+}
+
+TEST(KmerCodec, push) {
+  string seq = "GCCATGGAGATTGTGACCCTTTAGTTCCCCTAATGTTTGGTTCTCTTACTGTTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAAC";
+  int lengths[] = {4, 31, 32, 33, 40, 64};
+  for (int k : lengths) {
+    KmerCodec codec(k);
+    PackedKmer rolled, expected;
+    ASSERT_TRUE(codec.encode(seq.substr(0, k), &rolled));
+    for (size_t i = k; i < seq.size(); i++) {
+      codec.push(&rolled, nucleotide_code(seq[i]));
+      ASSERT_TRUE(codec.encode(seq.substr(i - k + 1, k), &expected));
+      ASSERT_EQ(expected, rolled);
+    }
+  }
+}
+
+TEST(KmerCodec, reverse_complement) {
+  string seq = "GCCATGGAGATTGTGACCCTTTAGTTCCCCTAATGTTTGGTTCTCTTACTGTTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAAC";
+  string rc_seq = "GTTACATTGGCTGGATTTATCAATGCTTTTAGTCTTTCAACAGTAAGAGAACCAAACATTAGGGGAACTAAAGGGTCACAATCTCCATGGC";
+  int lengths[] = {4, 31, 32, 33, 40, 64};
+  for (int k : lengths) {
+    KmerCodec codec(k);
+    PackedKmer kmer, rc, expected;
+    ASSERT_TRUE(codec.encode(seq.substr(0, k), &kmer));
+    rc = codec.reverse_complement(kmer);
+    ASSERT_EQ(rc_seq.substr(seq.size() - k), codec.decode(rc));
+    ASSERT_EQ(kmer, codec.reverse_complement(rc));
+    for (size_t i = k; i < seq.size(); i++) {
+      uint8_t code = nucleotide_code(seq[i]);
+      codec.push(&kmer, code);
+      codec.push_reverse_complement(&rc, code);
+      ASSERT_TRUE(codec.encode(rc_seq.substr(seq.size() - i - 1, k), &expected));
+      ASSERT_EQ(expected, rc);
+      ASSERT_EQ(codec.canonical(kmer), codec.canonical(rc));
+    }
+  }
+}
+
+TEST(KmerCodec, complement) {
+  int lengths[] = {4, 32, 33, 64};
+  for (int k : lengths) {
+    KmerCodec codec(k);
+    string seq, complement;
+    for (int i = 0; i < k; i++) {
+      seq.push_back("ACGT"[i * 7 % 4]);
+      complement.push_back("TGCA"[i * 7 % 4]);
+    }
+    PackedKmer kmer;
+    ASSERT_TRUE(codec.encode(seq, &kmer));
+    ASSERT_EQ(complement, codec.decode(codec.complement(kmer)));
+  }
+}
+
+TEST(KmerCodec, order) {
+  KmerCodec codec(40);
+  PackedKmer k1, k2;
+  ASSERT_TRUE(codec.encode("AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAC", &k1));
+  ASSERT_TRUE(codec.encode("CAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA", &k2));
+  ASSERT_TRUE(k1 < k2);
+  ASSERT_FALSE(k2 < k1);
+  ASSERT_TRUE(k1 != k2);
+}
+
+}  // namespace
+}  // namespace rs
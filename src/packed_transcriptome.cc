@@ -0,0 +1,61 @@
+#include <algorithm>
+
+#include "packed_kmer.h"
+#include "packed_transcriptome.h"
+
+namespace rs {
+
+namespace {
+
+const char kNucleotides[] = "ACGT";
+
+}  // namespace
+
+PackedSequence::PackedSequence(const string& seq)
+  : words_((seq.size() + 31) / 32, 0), size_(seq.size()) {
+  for (size_t i = 0; i < seq.size(); i++) {
+    uint8_t code = nucleotide_code(seq[i]);
+    if (code == kInvalidNucleotide || kNucleotides[code] != seq[i]) {
+      exceptions_.push_back(std::make_pair(i, seq[i]));
+      // the exception is decoded as 'A' first
+      if (code == kInvalidNucleotide) continue;
+    }
+    words_[i / 32] |= static_cast<uint64_t>(code) << (i % 32 * 2);
+  }
+  exceptions_.shrink_to_fit();
+}
+
+void PackedSequence::decode(string* seq) const {
+  seq->resize(size_);
+  char* out = &(*seq)[0];
+  for (size_t w = 0; w < words_.size(); w++) {
+    uint64_t word = words_[w];
+    size_t end = std::min(size_, w * 32 + 32);
+    for (size_t i = w * 32; i < end; i++) {
+      out[i] = kNucleotides[word & 3];
+      word >>= 2;
+    }
+  }
+  for (auto& e : exceptions_) {
+    out[e.first] = e.second;
+  }
+}
+
+void PackedTranscriptome::add(size_t index, const string& header,
+                              const vector<string>& seqs) {
+  PackedGene gene;
+  gene.header = header;
+  uint64_t num_bases = 0;
+  for (auto& seq : seqs) {
+    gene.transcripts.push_back(PackedSequence(seq));
+    num_bases += seq.size();
+  }
+  std::lock_guard<std::mutex> lock(m_);
+  if (genes_.size() <= index) {
+    genes_.resize(index + 1);
+  }
+  genes_[index] = std::move(gene);
+  num_bases_ += num_bases;
+}
+
+}  // namespace rs
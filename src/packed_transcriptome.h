@@ -0,0 +1,70 @@
+// This is used for keeping the transcript sequences in memory in two
+// bits per nucleotide, so that they can be scanned again without
+// reading and parsing the fasta file.
+
+#ifndef RS_PACKED_TRANSCRIPTOME_H
+#define RS_PACKED_TRANSCRIPTOME_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace rs {
+
+// A sequence in two bits per nucleotide (32 nucleotides per word). The
+// characters other than A, C, G and T (e.g. 'N' and the lower case
+// letters) are kept as exceptions, so the sequence is decoded exactly.
+class PackedSequence {
+public:
+  explicit PackedSequence(const string& seq);
+
+  // Sets seq to the original sequence, which reuses the memory of seq.
+  void decode(string* seq) const;
+  size_t size() const { return size_; }
+
+private:
+  vector<uint64_t> words_;
+  // the positions and the characters of the exceptions
+  vector<pair<uint32_t, char> > exceptions_;
+  size_t size_;
+};
+
+// The genes of a transcript fasta file, in the format of rs_cluster:
+// a gene has a header of ids and a sequence for every transcript.
+struct PackedGene {
+  string header;
+  vector<PackedSequence> transcripts;
+};
+
+// The genes are numbered by the order in the file, so they are in the
+// same order however the threads add them.
+class PackedTranscriptome {
+public:
+  PackedTranscriptome() : num_bases_(0) {}
+
+  // Adds the gene with the index (e.g. the index of the record in the
+  // fasta file). This is thread safe.
+  void add(size_t index, const string& header, const vector<string>& seqs);
+
+  // The genes can only be read after all of them are added, and every
+  // index less than size() must be added.
+  size_t size() const { return genes_.size(); }
+  const PackedGene& gene(size_t i) const { return genes_[i]; }
+  // the total length of the sequences
+  uint64_t num_bases() const { return num_bases_; }
+
+private:
+  vector<PackedGene> genes_;
+  uint64_t num_bases_;
+  std::mutex m_;
+};
+
+}  // namespace rs
+
+#endif  // RS_PACKED_TRANSCRIPTOME_H
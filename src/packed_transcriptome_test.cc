@@ -0,0 +1,60 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "rs_thread.h"
+
+#include "packed_transcriptome.h"
+
+namespace rs {
+namespace {
+
+TEST(PackedSequence, decode) {
+  string seqs[] = {
+    "",
+    "A",
+    "ACGTACGTACGTACGTACGTACGTACGTACGT",
+    "GCCATGGAGATTGTGACCCTTTAGTTCCCCTAATGTTTGGTTCTCTTACTGTTGAAAGACTAAAAG",
+    "NNACGTNacgtRYKMgcNN",
+  };
+  string decoded = "some old content";
+  for (auto& seq : seqs) {
+    PackedSequence packed(seq);
+    ASSERT_EQ(seq.size(), packed.size());
+    packed.decode(&decoded);
+    ASSERT_EQ(seq, decoded);
+  }
+}
+
+TEST(PackedTranscriptome, add) {
+  PackedTranscriptome transcriptome;
+  vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&transcriptome, t] {
+          for (int i = 0; i < 100; i++) {
+            // the genes of the threads are interleaved
+            int gene = i * 4 + t;
+            vector<string> seqs(gene % 3 + 1, string(gene, 'C'));
+            transcriptome.add(gene, std::to_string(gene), seqs);
+          }
+        }));
+  }
+  barrier(threads);
+  ASSERT_EQ(400, transcriptome.size());
+  uint64_t num_bases = 0;
+  string seq;
+  for (size_t i = 0; i < transcriptome.size(); i++) {
+    const PackedGene& gene = transcriptome.gene(i);
+    int id = std::stoi(gene.header);
+    ASSERT_EQ(i, id);
+    ASSERT_EQ(id % 3 + 1, gene.transcripts.size());
+    for (auto& transcript : gene.transcripts) {
+      transcript.decode(&seq);
+      ASSERT_EQ(string(id, 'C'), seq);
+      num_bases += seq.size();
+    }
+  }
+  ASSERT_EQ(num_bases, transcriptome.num_bases());
+}
+
+}  // namespace
+}  // namespace rs
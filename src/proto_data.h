@@ -1,9 +1,12 @@
 #ifndef _PROTO_DATA_H
 #define _PROTO_DATA_H
 
+#include <climits>
 #include <cstdio>
+#include <fcntl.h>
 #include <fstream>
 #include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
 #include "glog/logging.h"
 
 #include <memory>
@@ -15,63 +18,73 @@ using std::fstream;
 using std::fprintf;
 using std::unique_ptr;
 
-template<class T>
-bool load_protobuf_data(fstream *file, T *data,
-                        ::google::protobuf::uint8 *buffer,
-                        uint32_t buffer_size) {
-  int m;
-  if (file->eof()) return false;
-  file->read(reinterpret_cast<char *> (&m), sizeof(m));
-  if (file->eof()) return false;
-  if (buffer_size < m) {
-    LOG(ERROR) << "The buffer size (" << buffer_size
-               << ") is smaller than the size(" << m
-               << "). Skipped the current one";
-    file->seekg(m, std::ios_base::cur);
-    return false;
+// The messages are stored one by one in a file, every one of which is
+// the size of the message (a 32-bit integer) and the message.
+
+// The size of the blocks read from or written to the file at once.
+const int kProtobufBlockSize = 1024 * 1024;
+
+// Reads the messages from a file, which are parsed directly from the
+// blocks of the file, so there is no buffer for a whole message and a
+// message can be of any size.
+class ProtobufReader {
+public:
+  explicit ProtobufReader(const string& filename)
+    : fd_(open(filename.c_str(), O_RDONLY)) {
+    PLOG_IF(FATAL, fd_ < 0) << "Failed to open file " << filename;
+    input_.reset(new FileInputStream(fd_, kProtobufBlockSize));
+    input_->SetCloseOnDelete(true);
   }
-  file->read((char *) buffer, m);
-  // must use assign because '\0' might be part of the message.
-  // TODO: add unit test.
-  unique_ptr<CodedInputStream> input(new CodedInputStream(buffer, m));
-  input->SetTotalBytesLimit(1024 * 1024 * 1024, 10 * 1024 * 1024);
-  if (!data->ParseFromCodedStream(input.get())) {
-    fprintf(stderr, "Failed to parse the buffer. [fstream version]");
-    return false;
+
+  // Returns false at the end of the file, or if the message is broken.
+  template<class T>
+  bool read(T *data) {
+    CodedInputStream input(input_.get());
+    input.SetTotalBytesLimit(INT_MAX, INT_MAX);
+    uint32_t m;
+    if (!input.ReadLittleEndian32(&m)) return false;
+    CodedInputStream::Limit limit = input.PushLimit(m);
+    if (!data->ParseFromCodedStream(&input) ||
+        input.BytesUntilLimit() != 0) {
+      LOG(ERROR) << "Failed to parse the message of " << m << " bytes";
+      return false;
+    }
+    input.PopLimit(limit);
+    return true;
   }
-  return true;
-}
 
-// TODO(zzj): This function should not be copied. Refactor later.
-template<class T>
-bool load_protobuf_data(fstream *file, T *data) {
-  int m;
-  file->read(reinterpret_cast<char *> (&m), sizeof(m));
-  if (file->eof()) return false;
-  ::google::protobuf::uint8 * buffer = new ::google::protobuf::uint8[m + 1];
-  file->read((char *) buffer, m);
-  // must use assign because '\0' might be part of the message.
-  // TODO: add unit test.
-  unique_ptr<CodedInputStream> input(new CodedInputStream(buffer, m));
-  input->SetTotalBytesLimit(1024 * 1024 * 1024, 10 * 1024 * 1024);
-  if (!data->ParseFromCodedStream(input.get())) {
-    fprintf(stderr, "Failed to parse the buffer. [fstream version]");
-    delete buffer;
-    return false;
+private:
+  int fd_;
+  unique_ptr<FileInputStream> input_;
+};
+
+// Writes the messages into a file, which are serialized directly into
+// the blocks of the file. The file is flushed and closed when the
+// writer is deleted.
+class ProtobufWriter {
+public:
+  explicit ProtobufWriter(const string& filename)
+    : fd_(open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+    PLOG_IF(FATAL, fd_ < 0) << "Failed to open file " << filename;
+    output_.reset(new FileOutputStream(fd_, kProtobufBlockSize));
   }
-  delete buffer;
-  return true;
-}
 
-template<class T>
-bool write_protobuf_data(fstream *file, T *data) {
-  string seq;
-  data->SerializeToString(&seq);
-  int m = seq.size();
-  file->write(reinterpret_cast<char *> (&m), sizeof(m));
-  file->write(seq.c_str(), seq.size());
-  return true;
-}
+  ~ProtobufWriter() {
+    LOG_IF(ERROR, !output_->Close())
+      << "Failed to write the messages, errno=" << output_->GetErrno();
+  }
+
+  template<class T>
+  bool write(const T& data) {
+    CodedOutputStream output(output_.get());
+    output.WriteLittleEndian32(data.ByteSize());
+    data.SerializeWithCachedSizes(&output);
+    return !output.HadError();
+  }
 
+private:
+  int fd_;
+  unique_ptr<FileOutputStream> output_;
+};
 
 #endif  // _PROTO_DATA_H
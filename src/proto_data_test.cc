@@ -0,0 +1,71 @@
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "proto/rnasigs.pb.h"
+#include "proto_data.h"
+
+using std::string;
+namespace rs {
+namespace {
+
+SelectedKey make_selected_key(int i, int num_keys) {
+  SelectedKey sk;
+  sk.set_gid("G" + std::to_string(i));
+  sk.add_tids("T" + std::to_string(i));
+  sk.add_lengths(1000 + i);
+  for (int j = 0; j < num_keys; j++) {
+    SelectedKey::Key* key = sk.add_keys();
+    key->set_key(string(40, "ACGT"[(i + j) % 4]));
+    key->set_count(j);
+  }
+  return sk;
+}
+
+TEST(ProtobufReader, read_written_messages) {
+  string filename = "proto_data_test.tmp.pb";
+  // the second message is larger than a block of the file
+  int num_keys[] = {3, 100000, 0, 7};
+  {
+    ProtobufWriter writer(filename);
+    for (int i = 0; i < 4; i++) {
+      ASSERT_TRUE(writer.write(make_selected_key(i, num_keys[i])));
+    }
+  }
+  ProtobufReader reader(filename);
+  SelectedKey sk;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(reader.read(&sk));
+    ASSERT_EQ(make_selected_key(i, num_keys[i]).SerializeAsString(),
+              sk.SerializeAsString());
+  }
+  ASSERT_FALSE(reader.read(&sk));
+  remove(filename.c_str());
+}
+
+TEST(ProtobufReader, read_format) {
+  // the size of the message is a 32-bit integer before it
+  string filename = "proto_data_test.tmp.pb";
+  SelectedKey expected = make_selected_key(1, 2);
+  string message = expected.SerializeAsString();
+  int m = message.size();
+  {
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<char *>(&m), sizeof(m));
+    out.write(message.data(), message.size());
+    // a broken message at the end
+    out.write(reinterpret_cast<char *>(&m), sizeof(m));
+    out.write(message.data(), message.size() / 2);
+  }
+  ProtobufReader reader(filename);
+  SelectedKey sk;
+  ASSERT_TRUE(reader.read(&sk));
+  ASSERT_EQ(message, sk.SerializeAsString());
+  ASSERT_FALSE(reader.read(&sk));
+  remove(filename.c_str());
+}
+
+}  // namespace
+}  // namespace rs
@@ -1,3 +1,11 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <iostream>
 
 #include "rolling_hash_counter.h"
@@ -6,14 +14,62 @@
 
 namespace rs {
 
+namespace {
+
+const char kIndexMagic[8] = {'R', 'S', 'C', 'O', 'U', 'N', 'T', '1'};
+
+// A counter index file is the header, the capacity items of the hash
+// array, and then the key ids. The items are 8-byte aligned.
+struct CounterIndexHeader {
+  char magic[8];
+  uint32_t key_length;
+  uint32_t canonical;
+  uint64_t capacity;
+  uint64_t size;
+  uint64_t num_key_ids;
+  // the fingerprint of the keys given to save
+  uint64_t keys_fingerprint;
+  char padding[16];
+};
+
+static_assert(sizeof(CounterIndexHeader) == 64,
+              "The header of the counter index file should be 64 bytes");
+
+}  // namespace
+
 RollingHashArray::RollingHashArray(uint32_t capacity)
-  : capacity_(capacity), size_(0), hits(0), misses(0), empty_hits(0) {
+  : owns_arena_(true), capacity_(capacity), size_(0) {
   arena_ = new RollingHashItem[capacity];
+  // clear the padding too, so the saved index is the same for the
+  // same keys
+  memset(arena_, 0, sizeof(RollingHashItem) * capacity_);
+  for (uint32_t i = 0; i < capacity_; i++) {
+    arena_[i].id = kEmptyItemId;
+  }
+  // the ids are less than the capacity
+  values_ = new std::atomic<int>[capacity_];
   for (uint32_t i = 0; i < capacity_; i++) {
-    arena_[i].value.store(0);
+    values_[i].store(0);
   }
 }
 
+RollingHashArray::RollingHashArray(const RollingHashItem* items,
+                                   uint32_t capacity, uint32_t size)
+  : arena_(const_cast<RollingHashItem*>(items)), owns_arena_(false),
+    capacity_(capacity), size_(size) {
+  values_ = new std::atomic<int>[size_];
+  for (uint32_t i = 0; i < size_; i++) {
+    values_[i].store(0);
+  }
+}
+
+RollingHashArray::~RollingHashArray() {
+  if (owns_arena_) {
+    delete[] arena_;
+  }
+  delete[] values_;
+}
+
 RollingHashArray::iterator RollingHashArray::end() {
   return nullptr;
 }
@@ -26,31 +82,27 @@ uint32_t RollingHashArray::capacity() {
   return capacity_;
 }
 
-uint32_t RollingHashArray::index(uint32_t hashvalue) {
-  return hashvalue % capacity_;
-}
-
 // return false if the key is found.
 // return true if the key is empty.
 // terminated if the space is not available.
-bool RollingHashArray::find_next(uint32_t start, const StringPiece& key,
-                                 uint32_t* next) const {
+bool RollingHashArray::find_next(uint32_t start, const PackedKmer& key,
+                                 uint32_t* next, ProbeStats* stats) const {
   // linear prob to find next avaiable one.
   uint32_t last = start;
   while (true) {
-    if (LIKELY(arena_[start].key.size() == 0)) {
-      empty_hits.fetch_add(1, std::memory_order_relaxed);
+    if (LIKELY(arena_[start].id == kEmptyItemId)) {
+      stats->empty_hits ++;
       *next = start;
       return true;
     }
     // The running time does not improve when we only compare the prefix
     //if (compare_prefix(arena_[start].key, key, 10)) {
     if (UNLIKELY(arena_[start].key == key)) {
-      hits.fetch_add(1, std::memory_order_relaxed);
+      stats->hits ++;
       *next = start;
       return false;
     }
-    misses.fetch_add(1, std::memory_order_relaxed);
+    stats->misses ++;
     start = (start + 1) % capacity_;
     if (UNLIKELY(last == start)) {
       LOG(FATAL) << "The RollingHashArray is full" ;
@@ -58,111 +110,305 @@ bool RollingHashArray::find_next(uint32_t start, const StringPiece& key,
   }
 }
 
-bool RollingHashArray::insert(const StringPiece& key, uint32_t hashvalue,
+bool RollingHashArray::insert(const PackedKmer& key, uint32_t hashvalue,
                               const int value) {
+  LOG_IF(FATAL, !owns_arena_) << "Cannot insert into a loaded hash array";
   uint32_t available_index;
-  bool should_insert = find_next(index(hashvalue), key, &available_index);
+  ProbeStats stats = ProbeStats();
+  bool should_insert = find_next(index(hashvalue), key, &available_index,
+                                 &stats);
   if (should_insert) {
-    arena_[available_index].key = key.ToString();
-    arena_[available_index].value.store(value);
+    arena_[available_index].key = key;
+    arena_[available_index].id = size_;
+    values_[size_].store(value);
     size_ ++;
   }
   return should_insert;
 }
 
-bool RollingHashArray::increase(const StringPiece& key, uint32_t hashvalue,
-                                int delta) {
+bool RollingHashArray::increase(const PackedKmer& key, uint32_t hashvalue,
+                                int delta, ProbeStats* stats) {
   uint32_t key_index;
-  bool is_empty = find_next(index(hashvalue), key, &key_index);
+  ProbeStats local_stats = ProbeStats();
+  bool is_empty = find_next(index(hashvalue), key, &key_index,
+                            stats != nullptr ? stats : &local_stats);
   if (LIKELY(is_empty)) {
     return false;
   }
-  arena_[key_index].value.fetch_add(delta, std::memory_order_relaxed);
+  values_[arena_[key_index].id].fetch_add(delta, std::memory_order_relaxed);
   return true;
 }
 
-RollingHashArray::iterator RollingHashArray::find(const StringPiece& key,
-                                                  uint32_t hashvalue) const {
+RollingHashArray::iterator RollingHashArray::find(const PackedKmer& key,
+                                                  uint32_t hashvalue,
+                                                  ProbeStats* stats) const {
   uint32_t key_index;
-  bool is_not_found = find_next(index(hashvalue), key, &key_index);
+  ProbeStats local_stats = ProbeStats();
+  bool is_not_found = find_next(index(hashvalue), key, &key_index,
+                                stats != nullptr ? stats : &local_stats);
   if (is_not_found) {
     return NULL;
   }
   return &arena_[key_index];
 }
 
-RollingHashCounter::RollingHashCounter(const vector<string>& keys, double factor)
-  : capacity_(keys.size() * factor) {
+void RollingHashArray::add_values(const vector<uint32_t>& counts) {
+  for (uint32_t id = 0; id < size_; id++) {
+    if (counts[id] != 0) {
+      values_[id].fetch_add(counts[id], std::memory_order_relaxed);
+    }
+  }
+}
+
+RollingHashCounter::RollingHashCounter(const vector<string>& keys, double factor,
+                                       bool canonical, bool sharded)
+  : capacity_(keys.size() * factor), canonical_(canonical),
+    sharded_(sharded), mapped_(nullptr), mapped_size_(0),
+    key_ids_(nullptr), num_key_ids_(0), keys_fingerprint_(0) {
   // Make sure there is no thread level variable here
   LOG_IF(FATAL, keys.size() == 0) << "The keys size is 0.";
   key_length_ = keys[0].size();
-  hash_func_ = new KarpRobinHash(key_length_);
+  codec_ = new KmerCodec(key_length_);
   hash_array_ = new RollingHashArray(capacity_);
+  PackedKmer kmer;
   for (auto& key : keys) {
-    auto hashvalue = hash_func_->hash(key);
-    hash_array_->insert(key, hashvalue, 0);
+    if (!codec_->encode(key, &kmer)) {
+      LOG(ERROR) << "Skipped the key that cannot be packed: " << key;
+      continue;
+    }
+    if (canonical_) {
+      kmer = codec_->canonical(kmer);
+    }
+    hash_array_->insert(kmer, hash_kmer(kmer), 0);
+  }
+}
+
+RollingHashCounter::RollingHashCounter(const string& index_file,
+                                       bool sharded)
+  : sharded_(sharded) {
+  int fd = open(index_file.c_str(), O_RDONLY);
+  LOG_IF(FATAL, fd < 0) << "Failed to open the index file " << index_file;
+  struct stat st;
+  PLOG_IF(FATAL, fstat(fd, &st) != 0) << "Failed to stat " << index_file;
+  mapped_size_ = st.st_size;
+  LOG_IF(FATAL, mapped_size_ < sizeof(CounterIndexHeader))
+    << "The index file is broken: " << index_file;
+  void* addr = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+  PLOG_IF(FATAL, addr == MAP_FAILED) << "Failed to mmap " << index_file;
+  close(fd);
+  mapped_ = static_cast<char*>(addr);
+
+  const CounterIndexHeader* header =
+      reinterpret_cast<const CounterIndexHeader*>(mapped_);
+  LOG_IF(FATAL, memcmp(header->magic, kIndexMagic, sizeof(kIndexMagic)) != 0)
+    << "Not a counter index file: " << index_file;
+  size_t items_size = sizeof(RollingHashItem) * header->capacity;
+  LOG_IF(FATAL, mapped_size_ != sizeof(CounterIndexHeader) + items_size +
+         sizeof(uint32_t) * header->num_key_ids)
+    << "The index file is broken: " << index_file;
+  key_length_ = header->key_length;
+  capacity_ = header->capacity;
+  canonical_ = header->canonical != 0;
+  codec_ = new KmerCodec(key_length_);
+  hash_array_ = new RollingHashArray(
+      reinterpret_cast<const RollingHashItem*>(mapped_ + sizeof(*header)),
+      capacity_, header->size);
+  key_ids_ = reinterpret_cast<const uint32_t*>(
+      mapped_ + sizeof(*header) + items_size);
+  num_key_ids_ = header->num_key_ids;
+  keys_fingerprint_ = header->keys_fingerprint;
+  LOG(INFO) << "Loaded " << header->size << " keys from " << index_file;
+}
+
+RollingHashCounter::~RollingHashCounter() {
+  for (auto shard : shards_) {
+    delete shard;
+  }
+  delete hash_array_;
+  delete codec_;
+  if (mapped_ != nullptr) {
+    munmap(mapped_, mapped_size_);
+  }
+}
+
+void RollingHashCounter::save(const string& index_file,
+                              const vector<uint32_t>& key_ids,
+                              uint64_t keys_fingerprint) const {
+  CounterIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+  header.key_length = key_length_;
+  header.canonical = canonical_;
+  header.capacity = capacity_;
+  header.size = hash_array_->size();
+  header.num_key_ids = key_ids.size();
+  header.keys_fingerprint = keys_fingerprint;
+  // write to a temporary file first, so other processes never load a
+  // partial index
+  string tmp_file = index_file + ".tmp";
+  FILE* fp = fopen(tmp_file.c_str(), "wb");
+  PLOG_IF(FATAL, fp == nullptr) << "Failed to open " << tmp_file;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+      fwrite(hash_array_->items(), sizeof(RollingHashItem), capacity_, fp)
+      == capacity_ &&
+      fwrite(key_ids.data(), sizeof(uint32_t), key_ids.size(), fp)
+      == key_ids.size();
+  ok = fclose(fp) == 0 && ok;
+  PLOG_IF(FATAL, !ok) << "Failed to write " << tmp_file;
+  PLOG_IF(FATAL, rename(tmp_file.c_str(), index_file.c_str()) != 0)
+    << "Failed to rename " << tmp_file << " to " << index_file;
+}
+
+void* CountShard::operator new(size_t size) {
+  void* shard;
+  LOG_IF(FATAL, posix_memalign(&shard, alignof(CountShard), size) != 0)
+    << "Failed to allocate a count shard";
+  return shard;
+}
+
+void CountShard::operator delete(void* shard) {
+  free(shard);
+}
+
+CountShard* RollingHashCounter::new_shard() {
+  CountShard* shard = new CountShard();
+  if (sharded_) {
+    shard->counts_.resize(hash_array_->size());
   }
+  std::lock_guard<std::mutex> lock(shards_mutex_);
+  shards_.push_back(shard);
+  return shard;
+}
+
+void RollingHashCounter::merge(CountShard* shard) {
+  if (shard->counts_.empty()) return;
+  hash_array_->add_values(shard->counts_);
+  // the statistics are kept for dump_info
+  vector<uint32_t>().swap(shard->counts_);
 }
 
 // This function should be thread safe.
-void RollingHashCounter::process(const string& seq) {
-  LOG_IF(ERROR, seq.size() < key_length_)
+void RollingHashCounter::process(const StringPiece& seq, CountShard* shard) {
+  LOG_IF(ERROR, seq.size() < (int)key_length_)
     << "The seq size is smaller than the key_length: seq:" << seq
     << " key_length_:" << key_length_;
-  // we only want to look into the kmer without 'N'.
-  // if we found a 'N' in seq, we will skip all kmers that cover the
-  // 'N'
-  const char* p_start = seq.data();
-  const char* p_limit = seq.data() + seq.length();
-  // We need to copy the hash func here, since this function may be
-  // called by multiple threads
-  KarpRobinHash hash_func = *hash_func_;
-
-  while (p_start + key_length_ <= p_limit) {
-    const char* p_end = p_start + key_length_ - 1;
-    bool restart = false;
-    for (const char* j = p_end; j >= p_start; j--) {
-      if (UNLIKELY(*j == 'N')) {
-        // skipped
-        p_start = j + 1;
-        restart = true;
-        break;
+  // The read is encoded in one sweep, and we only want to look into
+  // the kmers without 'N' (or any character other than A, C, G and T),
+  // so the k-mers are rolled over each run of valid nucleotides.
+  static thread_local vector<uint8_t> codes;
+  static thread_local vector<uint64_t> invalid;
+  size_t size = seq.size();
+  if (codes.size() < size) {
+    codes.resize(size);
+    invalid.resize((size + 63) / 64);
+  }
+  encode_nucleotides(seq.data(), size, codes.data(), invalid.data());
+
+  ProbeBatch batch;
+  batch.size = 0;
+  size_t start = 0;
+  while (start + key_length_ <= size) {
+    size_t end = next_invalid(invalid.data(), start, size);
+    if (end - start >= key_length_) {
+      // The forward k-mer and its reverse complement are rolled
+      // together, and the hash value is computed from the packed key.
+      PackedKmer kmer = {0, 0}, rc = {0, 0};
+      for (size_t i = start; i < start + key_length_; i++) {
+        codec_->push(&kmer, codes[i]);
+        if (canonical_) {
+          codec_->push_reverse_complement(&rc, codes[i]);
+        }
+      }
+      add_probe(kmer, rc, &batch, shard);
+      for (size_t i = start + key_length_; i < end; i++) {
+        codec_->push(&kmer, codes[i]);
+        if (canonical_) {
+          codec_->push_reverse_complement(&rc, codes[i]);
+        }
+        add_probe(kmer, rc, &batch, shard);
       }
     }
-    if (UNLIKELY(restart)) continue;
-    StringPiece key(p_start, key_length_);
-    auto hashvalue = hash_func.hash(key);
-    hash_array_->increase(key, hashvalue, 1);
-    p_end ++;
-    for (; p_end < p_limit; p_start ++, p_end ++) {
-      if (UNLIKELY(*p_end == 'N')) {
-        p_start = p_end;
-        break;
+    start = end + 1;
+  }
+  flush_probes(&batch, shard);
+}
+
+void RollingHashCounter::add_probe(const PackedKmer& kmer,
+                                   const PackedKmer& rc, ProbeBatch* batch,
+                                   CountShard* shard) {
+  const PackedKmer& key = canonical_ && rc < kmer ? rc : kmer;
+  uint32_t hashvalue = hash_kmer(key);
+  hash_array_->prefetch(hashvalue);
+  batch->keys[batch->size] = key;
+  batch->hashvalues[batch->size] = hashvalue;
+  if (++batch->size == kProbeBatchSize) {
+    flush_probes(batch, shard);
+  }
+}
+
+void RollingHashCounter::flush_probes(ProbeBatch* batch, CountShard* shard) {
+  if (shard != nullptr && !shard->counts_.empty()) {
+    for (int i = 0; i < batch->size; i++) {
+      auto item = hash_array_->find(batch->keys[i], batch->hashvalues[i],
+                                    &shard->stats_);
+      if (item != nullptr) {
+        shard->counts_[item->id] ++;
       }
-      auto hashvalue = hash_func.update(*p_end,  // inchar
-                                        *p_start); // outchar
-      StringPiece key(p_start + 1, key_length_);
-      hash_array_->increase(key, hashvalue, 1);
     }
-    p_start ++;
+  } else {
+    ProbeStats* stats = shard != nullptr ? &shard->stats_ : nullptr;
+    for (int i = 0; i < batch->size; i++) {
+      hash_array_->increase(batch->keys[i], batch->hashvalues[i], 1, stats);
+    }
   }
+  batch->size = 0;
 }
 
 uint32_t RollingHashCounter::find(const string& key) const {
-  auto hashvalue = hash_func_->hash(key);
-  auto iter = hash_array_->find(key, hashvalue);
+  PackedKmer kmer;
+  if (UNLIKELY(!codec_->encode(key, &kmer))) {
+    LOG(ERROR) << "Misuse of the RollingHashCounter. "
+               << "The key cannot be packed: " << key;
+    return 0;
+  }
+  if (canonical_) {
+    kmer = codec_->canonical(kmer);
+  }
+  auto iter = hash_array_->find(kmer, hash_kmer(kmer));
   if (UNLIKELY(iter == nullptr)) {
     LOG(ERROR) << "Misuse of the RollingHashCounter. "
                << "The key does not exist in the hash counter";
     return 0;
   }
-  return iter->value.load(std::memory_order_relaxed);
+  return hash_array_->value(iter);
+}
+
+uint32_t RollingHashCounter::find_id(const string& key) const {
+  PackedKmer kmer;
+  if (!codec_->encode(key, &kmer)) return kEmptyItemId;
+  if (canonical_) {
+    kmer = codec_->canonical(kmer);
+  }
+  auto iter = hash_array_->find(kmer, hash_kmer(kmer));
+  return iter == nullptr ? kEmptyItemId : iter->id;
+}
+
+uint32_t RollingHashCounter::count(uint32_t id) const {
+  if (id == kEmptyItemId) return 0;
+  return hash_array_->value(id);
 }
 
 void RollingHashCounter::dump_info() {
-  LOG(INFO) << "Hits: " << hash_array_->hits;
-  LOG(INFO) << "Misses: " << hash_array_->misses;
-  LOG(INFO) << "Empty hits (last hit is empty item): " << hash_array_->empty_hits;
+  ProbeStats total = ProbeStats();
+  std::lock_guard<std::mutex> lock(shards_mutex_);
+  for (auto shard : shards_) {
+    total.hits += shard->stats_.hits;
+    total.misses += shard->stats_.misses;
+    total.empty_hits += shard->stats_.empty_hits;
+  }
+  LOG(INFO) << "Hits: " << total.hits;
+  LOG(INFO) << "Misses: " << total.misses;
+  LOG(INFO) << "Empty hits (last hit is empty item): " << total.empty_hits;
 }
 
 }  // namespace rs
@@ -5,20 +5,36 @@
 #define RS_HASHARRAY_H
 
 #include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "stringpiece.h"
-#include "karp_robin_hash.h"
+#include "packed_kmer.h"
 
 using std::vector;
 using std::string;
 
 namespace rs {
 
+const uint32_t kEmptyItemId = 0xffffffff;
+
+// The key is stored inline, so a probe does not need to chase a
+// pointer to the heap. The items are numbered by the order of the
+// insertion, and an empty item has the id kEmptyItemId. The values are
+// stored in a separate array by the ids, so the items are never changed
+// after the construction, and can be mapped from a file.
 struct RollingHashItem {
-  string key;
-  std::atomic<int> value;
+  PackedKmer key;
+  uint32_t id;
+};
+
+// The statistics of the probes of one thread. They are not shared by
+// the threads, so updating them does not cause any cache miss.
+struct ProbeStats {
+  long long hits;
+  long long empty_hits;
+  long long misses;
 };
 
 // The construction is not thread safe at all, only one thread (main) is
@@ -28,49 +44,161 @@ struct RollingHashItem {
 // the hash value for the function.
 class RollingHashArray {
 public:
-  typedef RollingHashItem* iterator;
+  typedef const RollingHashItem* iterator;
   RollingHashArray(uint32_t capacity);
+  // Uses the items of another hash array (e.g. in a mapped file), which
+  // are not owned by this object. No key can be inserted.
+  RollingHashArray(const RollingHashItem* items, uint32_t capacity,
+                   uint32_t size);
+  ~RollingHashArray();
 
   // This function is not thread safe, and should be called only in the
   // main thread
-  bool insert(const StringPiece& key, uint32_t hashvalue, const int value);
+  bool insert(const PackedKmer& key, uint32_t hashvalue, const int value);
 
   // This is thread safe
   // increase the counter by one of the key by one
-  bool increase(const StringPiece& key, uint32_t hashvalue, int delta = 1);
-
-  iterator find(const StringPiece& key, uint32_t hashvalue) const;
+  // The probes are added to stats if it is not nullptr.
+  bool increase(const PackedKmer& key, uint32_t hashvalue, int delta = 1,
+                ProbeStats* stats = nullptr);
+
+  iterator find(const PackedKmer& key, uint32_t hashvalue,
+                ProbeStats* stats = nullptr) const;
+  // Adds counts[id] to the value of the item with the id. This is
+  // thread safe.
+  void add_values(const vector<uint32_t>& counts);
+  int value(uint32_t id) const {
+    return values_[id].load(std::memory_order_relaxed);
+  }
+  int value(iterator item) const { return value(item->id); }
+  // All the capacity() items, which are empty if their ids are
+  // kEmptyItemId.
+  const RollingHashItem* items() const { return arena_; }
+  // Loads the first item probed for the hash value into the cache, so
+  // that a later operation with it does not wait for the memory.
+  void prefetch(uint32_t hashvalue) const {
+    __builtin_prefetch(&arena_[index(hashvalue)], 1);
+  }
   iterator end();
   uint32_t size();
   uint32_t capacity();
 
-  std::atomic<long long> hits;
-  std::atomic<long long> empty_hits;
-  std::atomic<long long> misses;
-
 private:
-  uint32_t index(uint32_t hashvalue);
-  bool find_next(uint32_t start, const StringPiece& key, uint32_t* next) const;
+  uint32_t index(uint32_t hashvalue) const { return hashvalue % capacity_; }
+  bool find_next(uint32_t start, const PackedKmer& key, uint32_t* next,
+                 ProbeStats* stats) const;
 
   RollingHashItem* arena_;
+  bool owns_arena_;
+  // the values by the ids of the items
+  std::atomic<int>* values_;
   uint32_t capacity_;
   uint32_t size_;
 };
 
+class RollingHashCounter;
+
+// The state of one counting thread. The probe statistics are always
+// kept per thread, and in the sharded mode, the thread also counts the
+// keys in its own array (by the ids of the keys), which is added to the
+// shared counters by RollingHashCounter::merge.
+// The statistics are updated on every probe, so every shard is on its
+// own cache lines, which are not shared with the shards of the other
+// threads.
+class alignas(64) CountShard {
+public:
+  const ProbeStats& stats() const { return stats_; }
+
+  // The shards are allocated on cache line boundaries, which new does
+  // not do for an over-aligned class before C++17.
+  static void* operator new(size_t size);
+  static void operator delete(void* shard);
+private:
+  friend class RollingHashCounter;
+  CountShard() : stats_() {}
+
+  vector<uint32_t> counts_;
+  ProbeStats stats_;
+};
+
 // The construction is not thread safe at all, only one thread (main) is
 // allowed to construct the object.
 // This is thread safe after the construction
+// In the canonical mode, a key and its reverse complement share one
+// item in the hash array, so find returns the total occurrences of both.
 class RollingHashCounter {
 public:
-  RollingHashCounter(const vector<string>& keys, double factor);
-  void process(const string& seq);
+  // In the sharded mode, every shard counts the keys in its own array,
+  // so the threads do not update the same counters (with atomic
+  // operations), but the counts are only found after merge.
+  RollingHashCounter(const vector<string>& keys, double factor,
+                     bool canonical = false, bool sharded = false);
+  // Loads the counter saved in the index file, whose hash array is
+  // mapped into memory instead of being built again.
+  explicit RollingHashCounter(const string& index_file, bool sharded = false);
+  ~RollingHashCounter();
+
+  // Writes the hash array to the index file, together with key_ids,
+  // which can be used for mapping the keys of the user (e.g. the
+  // selected keys) to the items, and are returned by key_ids() after
+  // the index file is loaded. keys_fingerprint identifies the keys of
+  // the user, so a loaded index can be checked against them, and is
+  // returned by keys_fingerprint().
+  void save(const string& index_file, const vector<uint32_t>& key_ids,
+            uint64_t keys_fingerprint) const;
+  const uint32_t* key_ids() const { return key_ids_; }
+  size_t num_key_ids() const { return num_key_ids_; }
+  uint64_t keys_fingerprint() const { return keys_fingerprint_; }
+  uint32_t key_length() const { return key_length_; }
+
+  // Returns a new shard owned by the counter, which should be used by
+  // only one thread.
+  CountShard* new_shard();
+  // Adds the counts of the shard to the counter.
+  void merge(CountShard* shard);
+
+  // The shard can be nullptr, which is the same as a shard in the
+  // non-sharded mode without the statistics.
+  void process(const StringPiece& seq, CountShard* shard = nullptr);
   uint32_t find(const string& key) const;
+  // Returns the id of the item of the key (in its canonical form in the
+  // canonical mode), or kEmptyItemId if the key is not in the counter.
+  uint32_t find_id(const string& key) const;
+  // The count of the item with the id, and 0 for kEmptyItemId.
+  uint32_t count(uint32_t id) const;
+  bool canonical() const { return canonical_; }
+  // Logs the probe statistics of all the shards.
   void dump_info();
 private:
-  KarpRobinHash *hash_func_;
+  // The keys of a read are probed in batches: the item of a key is
+  // prefetched when the key is added, and the whole batch is probed
+  // when it is full, so the cache misses of a batch overlap.
+  static const int kProbeBatchSize = 16;
+  struct ProbeBatch {
+    PackedKmer keys[kProbeBatchSize];
+    uint32_t hashvalues[kProbeBatchSize];
+    int size;
+  };
+
+  // rc is only used in the canonical mode
+  void add_probe(const PackedKmer& kmer, const PackedKmer& rc,
+                 ProbeBatch* batch, CountShard* shard);
+  void flush_probes(ProbeBatch* batch, CountShard* shard);
+
+  KmerCodec *codec_;
   RollingHashArray *hash_array_;
   uint32_t key_length_;
   uint32_t capacity_;
+  bool canonical_;
+  bool sharded_;
+  // the mapped index file, or nullptr if the counter is built from keys
+  char* mapped_;
+  size_t mapped_size_;
+  const uint32_t* key_ids_;
+  size_t num_key_ids_;
+  uint64_t keys_fingerprint_;
+  vector<CountShard*> shards_;
+  std::mutex shards_mutex_;
 };  // namespace rs
 
 }
@@ -10,14 +10,14 @@
 namespace rs {
 namespace {
 
+PackedKmer test_key(uint32_t i) {
+  PackedKmer key = {i % 7, i};
+  return key;
+}
+
 void setup_rolling_hash_array(RollingHashArray *rha, uint32_t size) {
-  vector<string> keys;
-  // need to create keys first because every key needs to be out live
-  // when query it.
-  char temp[10];
   for (uint32_t i = 0; i < size; i++) {
-    std::sprintf(temp, "%ud" , i);
-    rha->insert(temp, i, 0);
+    rha->insert(test_key(i), i, 0);
   }
   ASSERT_EQ(size, rha->size());
 }
@@ -26,10 +26,8 @@ TEST(RollingHashArray, test) {
   int test_size = 1000000;
   RollingHashArray rha(test_size);
   setup_rolling_hash_array(&rha, test_size);
-  char temp[10];
   for (uint32_t i = 0; i < rha.size(); i++) {
-    std::sprintf(temp, "%ud", i);
-    ASSERT_TRUE(rha.increase(temp, i, 1));
+    ASSERT_TRUE(rha.increase(test_key(i), i, 1));
   }
 }
 
@@ -39,11 +37,9 @@ public:
     : hash_array_(hash_array), rep_(rep) {}
 
   void run() {
-    char temp[10];
     for (uint32_t i = 0; i < hash_array_->size(); i++) {
-      std::sprintf(temp, "%ud", i);
       for (int rerun = 0; rerun < rep_; rerun ++) {
-        ASSERT_TRUE(hash_array_->increase(temp, i, 1));
+        ASSERT_TRUE(hash_array_->increase(test_key(i), i, 1));
       }
     }
   }
@@ -66,12 +62,10 @@ TEST(RollingHashArray, test_multi_thread) {
     threads.emplace_back(std::thread{RSThread(&test_thread)});
   }
   barrier(threads);
-  char temp[10];
   for (uint32_t i = 0; i < rha.size(); i++) {
-    std::sprintf(temp, "%ud", i);
-    RollingHashArray::iterator item = rha.find(temp, i);
+    RollingHashArray::iterator item = rha.find(test_key(i), i);
     ASSERT_TRUE(nullptr != item);
-    ASSERT_EQ(num_reps * num_threads, item->value);
+    ASSERT_EQ(num_reps * num_threads, rha.value(item));
   }
 }
 
@@ -86,6 +80,25 @@ TEST(RollingHashCounter, test) {
   ASSERT_EQ(0, counter.find("TTTT"));
 }
 
+TEST(RollingHashCounter, skip_invalid_nucleotides) {
+  vector<string> keys = {"ATCG", "CGAT", "GATC"};
+  RollingHashCounter counter(keys, 10);
+  counter.process("ATCGNTCGATCGAXCGAT");
+  ASSERT_EQ(2, counter.find("ATCG"));
+  ASSERT_EQ(2, counter.find("CGAT"));
+  ASSERT_EQ(1, counter.find("GATC"));
+}
+
+TEST(RollingHashCounter, lower_case_and_iupac) {
+  vector<string> keys = {"ATCG", "CGAT", "GATC"};
+  RollingHashCounter counter(keys, 10);
+  // the soft masked bases are counted, and the IUPAC codes are skipped
+  counter.process("atcgRTCGATcgAYCGAT");
+  ASSERT_EQ(2, counter.find("ATCG"));
+  ASSERT_EQ(2, counter.find("CGAT"));
+  ASSERT_EQ(1, counter.find("GATC"));
+}
+
 TEST(RollingHashCounter, another_test) {
   vector<string> keys = {"TTGAAAGACTAAAAGCATTGATAAATCCAGCCAATGTAAC",
                          "TTCCCCGGGACATGGTGCTCGGGGTCTGGACAGAACGGAG"};
@@ -99,6 +112,94 @@ TEST(RollingHashCounter, another_test) {
   ASSERT_EQ(1, counter.find("TTCCCCGGGACATGGTGCTCGGGGTCTGGACAGAACGGAG"));
 }
 
+class CounterTestThread : public ThreadInterface {
+public:
+  CounterTestThread(RollingHashCounter* counter, const string& seq, int rep)
+    : counter_(counter), seq_(seq), rep_(rep) {}
+
+  void run() {
+    CountShard* shard = counter_->new_shard();
+    for (int i = 0; i < rep_; i++) {
+      counter_->process(seq_, shard);
+    }
+    counter_->merge(shard);
+  }
+private:
+  RollingHashCounter* counter_;
+  string seq_;
+  int rep_;
+};
+
+TEST(RollingHashCounter, sharded_test) {
+  vector<string> keys = {"ATCG", "CGAT", "AAAA", "TTTT"};
+  string s = "ATCGATCGATCGATCGATCGATCG";
+  for (bool sharded : {false, true}) {
+    RollingHashCounter counter(keys, 10, false, sharded);
+    CounterTestThread test_thread(&counter, s, 100);
+    vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+      threads.emplace_back(std::thread{RSThread(&test_thread)});
+    }
+    barrier(threads);
+    ASSERT_EQ(6 * 800, counter.find("ATCG"));
+    ASSERT_EQ(5 * 800, counter.find("CGAT"));
+    ASSERT_EQ(0, counter.find("AAAA"));
+  }
+}
+
+TEST(RollingHashCounter, shards_on_own_cache_lines) {
+  vector<string> keys = {"ATCG", "CGAT"};
+  RollingHashCounter counter(keys, 10);
+  for (int i = 0; i < 8; i++) {
+    CountShard* shard = counter.new_shard();
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(shard) % 64);
+    ASSERT_EQ(0u, sizeof(*shard) % 64);
+  }
+}
+
+TEST(RollingHashCounter, save_and_load) {
+  vector<string> keys = {"ATCG", "CGAT", "AAAA", "TTTT"};
+  string index_file = "rolling_hash_counter_test.tmp.index";
+  string s = "ATCGATCGATCGATCGATCGATCG";
+  for (bool canonical : {false, true}) {
+    RollingHashCounter built(keys, 10, canonical);
+    vector<uint32_t> key_ids;
+    for (auto& key : keys) {
+      key_ids.push_back(built.find_id(key));
+    }
+    key_ids.push_back(built.find_id("GGGG"));
+    ASSERT_EQ(kEmptyItemId, key_ids.back());
+    built.save(index_file, key_ids, 0x1234567890abcdefULL);
+    built.process(s);
+
+    RollingHashCounter loaded(index_file);
+    ASSERT_EQ(canonical, loaded.canonical());
+    ASSERT_EQ(4u, loaded.key_length());
+    ASSERT_EQ(0x1234567890abcdefULL, loaded.keys_fingerprint());
+    ASSERT_EQ(key_ids.size(), loaded.num_key_ids());
+    for (size_t i = 0; i < key_ids.size(); i++) {
+      ASSERT_EQ(key_ids[i], loaded.key_ids()[i]);
+    }
+    loaded.process(s);
+    for (size_t i = 0; i < keys.size(); i++) {
+      ASSERT_EQ(built.find(keys[i]), loaded.find(keys[i]));
+      ASSERT_EQ(built.find(keys[i]), loaded.count(key_ids[i]));
+    }
+  }
+  std::remove(index_file.c_str());
+}
+
+TEST(RollingHashCounter, canonical_test) {
+  // CGTT is the reverse complement of AACG
+  vector<string> keys = {"AACG", "ACGT"};
+  RollingHashCounter counter(keys, 10, true);
+  counter.process("AACGTTAACG");
+  ASSERT_EQ(3, counter.find("AACG"));
+  ASSERT_EQ(3, counter.find("CGTT"));
+  // ACGT is the reverse complement of itself
+  ASSERT_EQ(1, counter.find("ACGT"));
+}
+
 class CounterThread : public ThreadInterface {
 public:
   CounterThread(RollingHashCounter *counter, const string& seq)
@@ -1,27 +1,145 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "glog/logging.h"
+#include "libbloomd/murmurhash/MurmurHash3.h"
+#include "mix_hash.h"
 #include "rs_bloom.h"
 #include "stringpiece.h"
 
 namespace rs {
 
-RSBloom::RSBloom(uint64_t capacity, double fp_probability) {
-  bloom_filter_params params = {0, 0, capacity, fp_probability};
-  bf_params_for_capacity(&params);
-  bitmap_from_file(-1, params.bytes, ANONYMOUS, &map_);
-  bf_from_bitmap(&map_, params.k_num, 1, &filter_);
+namespace {
+
+const uint64_t kBlockBits = 512;
+const uint64_t kBlockWords = kBlockBits / 64;
+// The keys are not spread evenly over the blocks, which is compensated
+// by using more bits than the standard bloom filter.
+const double kBlockedBitsFactor = 1.25;
+
+// Another hash value derived from a hash value, which is used for
+// choosing the bits in the block.
+uint64_t mix(uint64_t h) {
+  return mix_hash(h ^ 0x9e3779b97f4a7c15ULL);
+}
+
+}  // namespace
+
+RSBloom::RSBloom(uint64_t capacity, double fp_probability, bool blocked)
+  : blocked_(blocked), blocks_(nullptr), num_blocks_(0), k_num_(0) {
+  if (!blocked_) {
+    bloom_filter_params params = {0, 0, capacity, fp_probability};
+    bf_params_for_capacity(&params);
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map_);
+    bf_from_bitmap(&map_, params.k_num, 1, &filter_);
+    return;
+  }
+  capacity = std::max<uint64_t>(capacity, 1);
+  double bits = -(capacity * log(fp_probability) / (log(2) * log(2)));
+  k_num_ = std::min(16, std::max(1, (int) round(log(2) * bits / capacity)));
+  num_blocks_ = ceil(bits * kBlockedBitsFactor / kBlockBits);
+  void* blocks;
+  LOG_IF(FATAL, posix_memalign(&blocks, 64, num_blocks_ * kBlockBits / 8))
+    << "Failed to allocate a bloom filter of " << num_blocks_ << " blocks";
+  memset(blocks, 0, num_blocks_ * kBlockBits / 8);
+  blocks_ = static_cast<uint64_t*>(blocks);
 }
 
 RSBloom::~RSBloom() {
+  if (blocked_) {
+    free(blocks_);
+    return;
+  }
+  // this also closes map_
   bf_close(&filter_);
-  bitmap_close(&map_);
+}
+
+void RSBloom::block_mask(uint64_t h1, uint64_t h2, BlockMask* mask) {
+  mask->block = blocks_ + (h1 % num_blocks_) * kBlockWords;
+  memset(mask->words, 0, sizeof(mask->words));
+  // g_i = h1 + i * h2 (mod 512), the same as in libbloomd
+  uint32_t g1 = h2, g2 = (h2 >> 32) | 1;
+  for (uint32_t i = 0; i < k_num_; i++) {
+    uint32_t bit = (g1 + i * g2) % kBlockBits;
+    mask->words[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+// The first word of the block with a bit of the key that is not set
+// owns the key, and it is set after the other words. Only the thread
+// that sets the missing bits of the owner reports the key as new, so
+// at most one of the threads adding the same new key at the same time
+// reports it as new. If another key sets those bits in between, none
+// of them does.
+bool RSBloom::add_block_mask(const BlockMask& mask) {
+  uint64_t owner = 0;
+  uint64_t missing = 0;
+  for (; owner < kBlockWords; owner++) {
+    uint64_t word = __atomic_load_n(&mask.block[owner], __ATOMIC_ACQUIRE);
+    missing = mask.words[owner] & ~word;
+    if (missing != 0) break;
+  }
+  if (owner == kBlockWords) return false;
+  for (uint64_t i = owner + 1; i < kBlockWords; i++) {
+    if (mask.words[i] == 0) continue;
+    __atomic_fetch_or(&mask.block[i], mask.words[i], __ATOMIC_RELAXED);
+  }
+  uint64_t old = __atomic_fetch_or(&mask.block[owner], mask.words[owner],
+                                   __ATOMIC_RELEASE);
+  // another thread set the bits of the owner after they were loaded
+  return (old & missing) != missing;
+}
+
+bool RSBloom::contain_block_mask(const BlockMask& mask) {
+  for (uint64_t i = 0; i < kBlockWords; i++) {
+    uint64_t word = __atomic_load_n(&mask.block[i], __ATOMIC_RELAXED);
+    if ((word & mask.words[i]) != mask.words[i]) return false;
+  }
+  return true;
 }
 
 bool RSBloom::add(const StringPiece &key) {
-  int ret = bf_add(&filter_, key.data(), key.size());
-  return ret != 0;
+  if (!blocked_) {
+    int ret = bf_add(&filter_, key.data(), key.size());
+    return ret != 0;
+  }
+  uint64_t hashes[2];
+  MurmurHash3_x64_128(key.data(), key.size(), 0, hashes);
+  BlockMask mask;
+  block_mask(hashes[0], hashes[1], &mask);
+  return add_block_mask(mask);
 }
 
 bool RSBloom::contain(const StringPiece &key) {
-  return bf_contains(&filter_, key.data(), key.size());
+  if (!blocked_) {
+    return bf_contains(&filter_, key.data(), key.size());
+  }
+  uint64_t hashes[2];
+  MurmurHash3_x64_128(key.data(), key.size(), 0, hashes);
+  BlockMask mask;
+  block_mask(hashes[0], hashes[1], &mask);
+  return contain_block_mask(mask);
+}
+
+bool RSBloom::add_hash(uint64_t hashvalue) {
+  if (!blocked_) {
+    return bf_add_hash(&filter_, hashvalue) != 0;
+  }
+  BlockMask mask;
+  block_mask(hashvalue, mix(hashvalue), &mask);
+  return add_block_mask(mask);
+}
+
+bool RSBloom::contain_hash(uint64_t hashvalue) {
+  if (!blocked_) {
+    return bf_contains_hash(&filter_, hashvalue);
+  }
+  BlockMask mask;
+  block_mask(hashvalue, mix(hashvalue), &mask);
+  return contain_block_mask(mask);
 }
 
 }  // namespace rs
@@ -1,5 +1,9 @@
 // This is a wrapper of libbloomd in C++.
 // libbloomd is a lock free implementation of bloom filter.
+// The blocked bloom filter keeps all the bits of a key in one 64-byte
+// block (a cache line), so adding or looking up a key costs at most one
+// cache miss instead of one per hash function. It needs a few more bits
+// than the standard one for the same false positive probability.
 
 #ifndef RS_BLOOM_H
 #define RS_BLOOM_H
@@ -16,13 +20,35 @@ class StringPiece;
 
 class RSBloom {
  public:
-  RSBloom(uint64_t capacity, double fp_probability);
+  RSBloom(uint64_t capacity, double fp_probability, bool blocked = false);
   ~RSBloom();
+  // Returns true if the key is not in the filter before.
   bool add(const StringPiece &key);
   bool contain(const StringPiece &key);
+  // The same as add and contain, but the key is given by a well mixed
+  // 64-bit hash value (e.g. of a rolling hash), so it is not hashed
+  // again. A filter should only be used with either the keys or the
+  // hash values.
+  bool add_hash(uint64_t hashvalue);
+  bool contain_hash(uint64_t hashvalue);
  private:
+  // The masks of the bits of a key in its block.
+  struct BlockMask {
+    uint64_t* block;
+    uint64_t words[8];
+  };
+  // h1 chooses the block, and h2 chooses the bits in the block.
+  void block_mask(uint64_t h1, uint64_t h2, BlockMask* mask);
+  bool add_block_mask(const BlockMask& mask);
+  bool contain_block_mask(const BlockMask& mask);
+
+  bool blocked_;
   bloom_bitmap map_;
   bloom_bloomfilter filter_;
+  // the blocked bloom filter
+  uint64_t* blocks_;
+  uint64_t num_blocks_;
+  uint32_t k_num_;
 };
 
 }  // namespace rs
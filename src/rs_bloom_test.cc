@@ -1,6 +1,8 @@
+#include <atomic>
 #include <thread>
 #include "gtest/gtest.h"
 
+#include "cyclic_hash.h"
 #include "fa_reader.h"
 #include "rs_bloom.h"
 #include "rs_thread.h"
@@ -28,11 +30,128 @@ private:
 };
 
 TEST(RSBloom, single_thread_test) {
-  RSBloom bloom(1000, 0.0001);
-  std::string key = "abc";
-  ASSERT_TRUE(bloom.add(key));
-  ASSERT_FALSE(bloom.add(key));
-  ASSERT_TRUE(bloom.contain(key));
+  for (bool blocked : {false, true}) {
+    RSBloom bloom(1000, 0.0001, blocked);
+    std::string key = "abc";
+    ASSERT_TRUE(bloom.add(key));
+    ASSERT_FALSE(bloom.add(key));
+    ASSERT_TRUE(bloom.contain(key));
+  }
+}
+
+TEST(RSBloom, false_positive_test) {
+  int capacity = 100000;
+  for (bool blocked : {false, true}) {
+    RSBloom bloom(capacity, 0.001, blocked);
+    for (int i = 0; i < capacity; i++) {
+      bloom.add("key" + std::to_string(i));
+    }
+    int false_positives = 0;
+    for (int i = 0; i < capacity; i++) {
+      ASSERT_TRUE(bloom.contain("key" + std::to_string(i)));
+      false_positives += bloom.contain("other" + std::to_string(i));
+    }
+    // the expected number is 100
+    ASSERT_LT(false_positives, 300);
+  }
+}
+
+TEST(RSBloom, hash_false_positive_test) {
+  int capacity = 100000;
+  CyclicHash hasher(12);
+  for (bool blocked : {false, true}) {
+    RSBloom bloom(capacity, 0.001, blocked);
+    for (int i = 0; i < capacity; i++) {
+      uint64_t hashvalue = hasher.hash("key" + std::to_string(i + 1000000));
+      bloom.add_hash(hashvalue);
+      ASSERT_FALSE(bloom.add_hash(hashvalue));
+    }
+    int false_positives = 0;
+    for (int i = 0; i < capacity; i++) {
+      ASSERT_TRUE(bloom.contain_hash(
+          hasher.hash("key" + std::to_string(i + 1000000))));
+      false_positives += bloom.contain_hash(
+          hasher.hash("oth" + std::to_string(i + 1000000)));
+    }
+    ASSERT_LT(false_positives, 300);
+  }
+}
+
+class AddThread : public ThreadInterface {
+public:
+  AddThread(RSBloom* bloom, int num_keys) : bloom_(bloom), num_keys_(num_keys),
+                                            next_thread_(0) {}
+
+  void run() {
+    int thread = next_thread_.fetch_add(1);
+    for (int i = 0; i < num_keys_; i++) {
+      bloom_->add(std::to_string(thread) + "_" + std::to_string(i));
+    }
+  }
+private:
+  RSBloom* bloom_;
+  int num_keys_;
+  std::atomic<int> next_thread_;
+};
+
+TEST(RSBloom, concurrent_add_test) {
+  int num_threads = 8;
+  int num_keys = 50000;
+  for (bool blocked : {false, true}) {
+    // no bit set by a thread is lost, even when the bits of the threads
+    // often share bytes
+    RSBloom bloom(num_threads * num_keys, 0.3, blocked);
+    AddThread add_thread(&bloom, num_keys);
+    vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+      threads.emplace_back(std::thread{RSThread(&add_thread)});
+    }
+    barrier(threads);
+    for (int t = 0; t < num_threads; t++) {
+      for (int i = 0; i < num_keys; i++) {
+        ASSERT_TRUE(bloom.contain(std::to_string(t) + "_" + std::to_string(i)));
+      }
+    }
+  }
+}
+
+// All the threads add the same keys, and count how many times every
+// key is reported as new.
+class RaceThread : public ThreadInterface {
+public:
+  RaceThread(RSBloom* bloom, vector<std::atomic<int> >* new_counts)
+    : bloom_(bloom), new_counts_(new_counts) {}
+
+  void run() {
+    for (size_t i = 0; i < new_counts_->size(); i++) {
+      if (bloom_->add("key" + std::to_string(i))) {
+        (*new_counts_)[i]++;
+      }
+    }
+  }
+private:
+  RSBloom* bloom_;
+  vector<std::atomic<int> >* new_counts_;
+};
+
+TEST(RSBloom, concurrent_same_key_test) {
+  int num_threads = 8;
+  int num_keys = 50000;
+  for (bool blocked : {false, true}) {
+    // a large filter, so the keys rarely share bits
+    RSBloom bloom(num_keys * 100, 0.0001, blocked);
+    vector<std::atomic<int> > new_counts(num_keys);
+    for (auto& count : new_counts) count = 0;
+    RaceThread race_thread(&bloom, &new_counts);
+    vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+      threads.emplace_back(std::thread{RSThread(&race_thread)});
+    }
+    barrier(threads);
+    for (int i = 0; i < num_keys; i++) {
+      ASSERT_EQ(1, new_counts[i]) << "key" << i;
+    }
+  }
 }
 
 TEST(RSBloom, multi_thread_test) {
@@ -40,24 +159,26 @@ TEST(RSBloom, multi_thread_test) {
     "test_data/fa_reader_test.fasta.1",
     "test_data/fa_reader_test.fasta.2",
   };
-  SingleFastaReader fa_reader(test_filenames[0]);
-  RSBloom bloom(10000, 0.001);
-
-  reader_thread rt1(&fa_reader, &bloom), rt2(&fa_reader, &bloom);
-  std::thread t1{RSThread(&rt1)};
-  std::thread t2{RSThread(&rt2)};
-  t1.join();
-  t2.join();
-  fa_reader.reset();
-  vector<string> ids, seqs;
-  while(fa_reader.read(&ids, &seqs) != 0) {
-    for (string seq : seqs) {
-      bloom.add(seq);
-      ASSERT_TRUE(bloom.contain(seq));
+  for (bool blocked : {false, true}) {
+    SingleFastaReader fa_reader(test_filenames[0]);
+    RSBloom bloom(10000, 0.001, blocked);
+
+    reader_thread rt1(&fa_reader, &bloom), rt2(&fa_reader, &bloom);
+    std::thread t1{RSThread(&rt1)};
+    std::thread t2{RSThread(&rt2)};
+    t1.join();
+    t2.join();
+    fa_reader.reset();
+    vector<string> ids, seqs;
+    while(fa_reader.read(&ids, &seqs) != 0) {
+      for (string seq : seqs) {
+        bloom.add(seq);
+        ASSERT_TRUE(bloom.contain(seq));
+      }
     }
+    std::string nokey = "ABC";
+    ASSERT_FALSE(bloom.contain(nokey));
   }
-  std::string nokey = "ABC";
-  ASSERT_FALSE(bloom.contain(nokey));
 }
 
 }  // namespace
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <string>
 #include <vector>
 #include <thread>
@@ -5,15 +6,19 @@
 #include <iostream>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <cstdio>
 #include <omp.h>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "cyclic_hash.h"
 #include "fa_reader.h"
-#include "rs_bloom.h"
+#include "kmer_hash_set.h"
+#include "kmer_sketch.h"
 #include "rs_common.h"
+#include "union_find.h"
 
 using namespace std;
 
@@ -26,10 +31,21 @@ DEFINE_int32(num_threads, -1,
              "[default: -1]: the num of CPUs in the machine.");
 DEFINE_int32(rs_length, 40,
              "The length of the RS signature.");
+DEFINE_int32(sketch_size, 0,
+             "The number of the smallest k-mer hash values kept for every "
+             "gene (a bottom-k MinHash sketch). If it is positive, the "
+             "similarity is estimated from the sketches (e.g. 1000), which "
+             "is faster for large references, instead of from the k-mers "
+             "sampled from the transcripts. [default: 0]: sample k-mers.");
 DEFINE_double(threshold, 0.1,
               "The threshold of minimum similarity for adding edges to the graph");
-DEFINE_string(map_file, "overlap_map",
-              "The file for storing the graph inforamtion");
+DEFINE_string(map_file, "",
+              "The file for storing the graph inforamtion, in which every "
+              "pair of genes sharing k-mers is four 32-bit integers: the "
+              "indexes of the two genes in gene_fasta, the number of the "
+              "k-mers of the first gene in the second one, and the number "
+              "of the k-mers of the first gene. [default: \"\"]: not "
+              "written.");
 
 namespace rs {
 
@@ -41,17 +57,72 @@ public:
   vector<string> seqs;
   // transcript id
   vector<string> tids;
-  // bloom filter for all subsequences in this one
-  RSBloom* bloom_filter;
-  // index in the vector of FastaRecords
-  set<int> similar_genes;
 };
 
-void add_into_bloom_filter(string& seq, RSBloom* bloom) {
+// The edges between the similar genes, which are added by many threads.
+// The genes are merged into the same cluster if the similarity is no
+// less than the threshold, and all the edges are written into the map
+// file if there is one.
+class SimilarityGraph {
+public:
+  SimilarityGraph(size_t num_genes, const string& map_file)
+    : clusters_(num_genes), fd_(nullptr), num_loaded_edges_(0),
+      num_edges_(0) {
+    if (!map_file.empty()) {
+      fd_ = fopen(map_file.c_str(), "wb");
+      PLOG_IF(FATAL, fd_ == nullptr) << "Failed to open file " << map_file;
+    }
+  }
+
+  ~SimilarityGraph() {
+    if (fd_ != nullptr) fclose(fd_);
+  }
+
+  // dup of the total k-mers of gene i are in gene j.
+  void add_edge(int i, int j, int dup, int total) {
+    if (fd_ != nullptr) {
+      int32_t edge[4] = {i, j, dup, total};
+      // http://www.gnu.org/software/libc/manual/html_node/Streams-and-Threads.html#Streams-and-Threads
+      // The POSIX standard requires that by default the stream
+      // operations are atomic. I.e., issuing two stream operations
+      // for the same stream in two threads at the same time will
+      // cause the operations to be executed as if they were issued
+      // sequentially.
+      fwrite(edge, sizeof(edge), 1, fd_);
+    }
+    num_loaded_edges_ ++;
+    if (dup * 1.0 / total >= FLAGS_threshold) {
+      clusters_.unite(i, j);
+      num_edges_ ++;
+    }
+  }
+
+  UnionFind* clusters() { return &clusters_; }
+  int num_loaded_edges() const { return num_loaded_edges_; }
+  int num_edges() const { return num_edges_; }
+
+private:
+  UnionFind clusters_;
+  FILE* fd_;
+  std::atomic<int> num_loaded_edges_;
+  std::atomic<int> num_edges_;
+};
+
+// Calls f with the rolling hash value of every k-mer in the seq, which
+// is the same in all the four orientations (normal, complimentary,
+// reversed, and both).
+template <typename F>
+void for_each_kmer_hash(const string& seq, CanonicalCyclicHash* hasher,
+                        F f) {
   if ((int) seq.size() < FLAGS_rs_length) return;
-  for (int start = 0; start < (int)seq.size() - FLAGS_rs_length;
+  uint64_t hashvalue = hasher->hash(StringPiece(seq.data(), FLAGS_rs_length));
+  for (int start = 0; start <= (int)seq.size() - FLAGS_rs_length;
        start ++) {
-    bloom->add(StringPiece(seq.data() + start, FLAGS_rs_length));
+    if (start > 0) {
+      hashvalue = hasher->update(seq[start + FLAGS_rs_length - 1],
+                                 seq[start - 1]);
+    }
+    f(hashvalue);
   }
 }
 
@@ -74,25 +145,6 @@ void load_records(const string& filename, vector<FastaRecord> *records) {
       ids.erase(ids.begin());
       fr.seqs = seqs;
       fr.tids = ids;
-      fr.bloom_filter = new RSBloom(whole_seq.size() * 4, 0.001);
-      for (const string& seq : fr.seqs) {
-        // add four different possible sequences into bloom
-        // normal
-        string temp = seq;
-        add_into_bloom_filter(temp, fr.bloom_filter);
-
-        // complimentary
-        compliment(&temp);
-        add_into_bloom_filter(temp, fr.bloom_filter);
-
-        // complimentary and reversed
-        reverse(temp.begin(), temp.end());
-        add_into_bloom_filter(temp, fr.bloom_filter);
-
-        // reversed and normal
-        compliment(&temp);
-        add_into_bloom_filter(temp, fr.bloom_filter);
-      }
       records->push_back(fr);
     }
     total += ids.size();
@@ -101,97 +153,154 @@ void load_records(const string& filename, vector<FastaRecord> *records) {
   LOG(INFO) << "Data is loaded";
 }
 
-void calculate_similarity(vector<FastaRecord> *records) {
-  FILE* fd = fopen(FLAGS_map_file.c_str(), "w+");
-  #pragma omp parallel for
-  for (size_t i = 0; i < records->size(); i++) {
-    const FastaRecord& ri = records->at(i);
-    vector<string> samples;
-    for (const string& seq : ri.seqs) {
-      vector<string> temp = evenly_sample(seq, FLAGS_rs_length, 20);
-      samples.insert(samples.end(), temp.begin(), temp.end());
-    }
-    for (size_t j = 0; j < records->size(); j++) {
-      if (i == j) continue;
-      int total = 0;
-      int dup = 0;
-      const FastaRecord& rj = records->at(j);
-      for (const string& sample : samples) {
-        if (rj.bloom_filter->contain(sample)) {
-          dup ++;
-        }
-        total ++;
-      }
-      if (dup >= 1) {
-        // http://www.gnu.org/software/libc/manual/html_node/Streams-and-Threads.html#Streams-and-Threads
-        // The POSIX standard requires that by default the stream
-        // operations are atomic. I.e., issuing two stream operations
-        // for the same stream in two threads at the same time will
-        // cause the operations to be executed as if they were issued
-        // sequentially.
-        fprintf(fd, "%s\t%s\t%d\t%d\n", ri.gid.c_str(), rj.gid.c_str(), dup, total);
+// Sets the hash values of the k-mers sampled from the transcripts of
+// the gene, and the number of the samples. The samples shorter than
+// rs_length (at the end of a short transcript) are counted, but they
+// are never found in other genes.
+void sample_kmer_hashes(const FastaRecord& record,
+                        CanonicalCyclicHash* hasher,
+                        vector<uint64_t>* hashes, int* total) {
+  hashes->clear();
+  *total = 0;
+  for (const string& seq : record.seqs) {
+    for (const string& sample : evenly_sample(seq, FLAGS_rs_length, 20)) {
+      if ((int) sample.size() == FLAGS_rs_length) {
+        hashes->push_back(hasher->hash(sample));
       }
+      (*total) ++;
     }
   }
-  fclose(fd);
+}
 
-  fd = fopen(FLAGS_map_file.c_str(), "r");
-  int dup, total;
-  char g1[200], g2[200];
-  map<string, int> gid2idx;
-  for (size_t i = 0; i < records->size(); i++) {
-    const FastaRecord& ri = records->at(i);
-    gid2idx[ri.gid] = i;
-  }
-  int num_edges = 0;
-  int num_loaded_edges = 0;
-  while(fscanf(fd, "%s%s%d%d", g1, g2, &dup, &total) == 4) {
-    if (dup * 1.0 / total >= FLAGS_threshold) {
-      records->at(gid2idx[g1]).similar_genes.insert(gid2idx[g2]);
-      records->at(gid2idx[g2]).similar_genes.insert(gid2idx[g1]);
-      num_edges ++;
+// The similarity of gene i to gene j is the fraction of the samples of
+// gene i which are k-mers of gene j. Instead of testing the samples of
+// every gene against all the other genes, the genes are indexed by
+// their samples, and the k-mers of gene j are looked up in the index,
+// so gene j only meets the genes whose samples are in it.
+void find_similar_by_samples(const vector<FastaRecord>& records,
+                             SimilarityGraph* graph) {
+  vector<vector<uint64_t> > samples(records.size());
+  vector<int> totals(records.size());
+  #pragma omp parallel
+  {
+    CanonicalCyclicHash hasher(FLAGS_rs_length);
+    #pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < records.size(); i++) {
+      sample_kmer_hashes(records[i], &hasher, &samples[i], &totals[i]);
     }
-    num_loaded_edges ++;
   }
-  LOG(INFO) << "Map is loaded. "
-             << num_loaded_edges << " loaded into the memory."
-             << num_edges << " added to the map.";
-  fclose(fd);
-}
-
-void dfs(const vector<FastaRecord>& records,
-         int start,
-         set<int>* connected_nodes,
-         set<int>* visited_nodes) {
+  // the genes sampling every k-mer, once for every time it is sampled
+  unordered_map<uint64_t, vector<int> > sampled_by;
+  for (size_t i = 0; i < records.size(); i++) {
+    for (uint64_t hashvalue : samples[i]) {
+      sampled_by[hashvalue].push_back(i);
+    }
+  }
+  LOG(INFO) << sampled_by.size() << " k-mers are sampled";
 
-  if (visited_nodes->find(start) != visited_nodes->end()) return;
-  connected_nodes->insert(start);
-  visited_nodes->insert(start);
-  for (int next_gidx : records[start].similar_genes) {
-    dfs(records, next_gidx, connected_nodes, visited_nodes);
+  #pragma omp parallel
+  {
+    CanonicalCyclicHash hasher(FLAGS_rs_length);
+    // the sampled k-mers found in gene j, which are counted only once
+    KmerHashSet found;
+    // the number of the samples of gene i found in gene j
+    map<int, int> dups;
+    #pragma omp for schedule(dynamic)
+    for (size_t j = 0; j < records.size(); j++) {
+      const FastaRecord& rj = records[j];
+      found.clear();
+      dups.clear();
+      for (const string& seq : rj.seqs) {
+        for_each_kmer_hash(seq, &hasher, [&](uint64_t hashvalue) {
+            auto it = sampled_by.find(hashvalue);
+            if (it == sampled_by.end() || !found.insert(hashvalue)) return;
+            for (int i : it->second) {
+              if (i != (int) j) dups[i] ++;
+            }
+          });
+      }
+      for (auto& dup : dups) {
+        graph->add_edge(dup.first, j, dup.second, totals[dup.first]);
+      }
+    }
   }
 }
 
-void cluster(const vector<FastaRecord>& records,
-             vector<vector<int> > *cluster_results) {
-  cluster_results->resize(records.size());
-  set<int> visited_nodes;
-  for (size_t i = 0; i < records.size(); i ++) {
-    if (visited_nodes.find(i) != visited_nodes.end()) {
-      continue;
+// The similarity of gene i to gene j is estimated from their sketches,
+// by the fraction of the hash values of gene i which are in gene j
+// (see KmerSketch::containment). The genes are indexed by the hash
+// values in their sketches, and gene j is only compared with the genes
+// sharing a hash value with it, since the others have no hash value in
+// gene j.
+void find_similar_by_sketches(const vector<FastaRecord>& records,
+                              SimilarityGraph* graph) {
+  vector<KmerSketch> sketches(records.size(), KmerSketch(FLAGS_sketch_size));
+  #pragma omp parallel
+  {
+    CanonicalCyclicHash hasher(FLAGS_rs_length);
+    #pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < records.size(); i++) {
+      for (const string& seq : records[i].seqs) {
+        for_each_kmer_hash(seq, &hasher, [&](uint64_t hashvalue) {
+            sketches[i].add(hashvalue);
+          });
+      }
+      sketches[i].finish();
     }
-    if (records[i].similar_genes.size() == 0) {
-      cluster_results->at(i).push_back(i);
-      continue;
+  }
+  unordered_map<uint64_t, vector<int> > sketched_by;
+  for (size_t i = 0; i < records.size(); i++) {
+    for (uint64_t hashvalue : sketches[i].hashes()) {
+      sketched_by[hashvalue].push_back(i);
     }
-    set<int> connected_nodes;
-    dfs(records, i, &connected_nodes, &visited_nodes);
-    for (int gidx : connected_nodes) {
-      cluster_results->at(i).push_back(gidx);
+  }
+  LOG(INFO) << "The genes are sketched with "
+            << sketched_by.size() << " hash values";
+
+  #pragma omp parallel
+  {
+    set<int> candidates;
+    #pragma omp for schedule(dynamic)
+    for (size_t j = 0; j < records.size(); j++) {
+      candidates.clear();
+      for (uint64_t hashvalue : sketches[j].hashes()) {
+        for (int i : sketched_by.at(hashvalue)) {
+          if (i != (int) j) candidates.insert(i);
+        }
+      }
+      for (int i : candidates) {
+        int dup, total;
+        sketches[i].containment(sketches[j], &dup, &total);
+        if (dup >= 1) {
+          graph->add_edge(i, j, dup, total);
+        }
+      }
     }
   }
 }
 
+void calculate_similarity(const vector<FastaRecord>& records,
+                          SimilarityGraph* graph) {
+  if (FLAGS_sketch_size > 0) {
+    find_similar_by_sketches(records, graph);
+  } else {
+    find_similar_by_samples(records, graph);
+  }
+  LOG(INFO) << "Similarity is calculated. "
+            << graph->num_loaded_edges() << " pairs of genes share k-mers. "
+            << graph->num_edges() << " added to the map.";
+}
+
+// The genes of a cluster are in the same order as in the fasta file,
+// and the cluster is at the index of its first gene, which is the root
+// of the cluster.
+void cluster(UnionFind* clusters, vector<vector<int> > *cluster_results) {
+  cluster_results->resize(clusters->size());
+  for (size_t i = 0; i < clusters->size(); i ++) {
+    cluster_results->at(clusters->find(i)).push_back(i);
+  }
+}
+
 void dump_result(const vector<FastaRecord>& records,
                  const vector<vector<int> >& cluster_results) {
   FILE *fd = fopen(FLAGS_output.c_str(), "w+");
@@ -233,10 +342,11 @@ int main(int argc, char *argv[]) {
   vector<rs::FastaRecord> records;
   rs::load_records(FLAGS_gene_fasta, &records);
 
-  rs::calculate_similarity(&records);
+  rs::SimilarityGraph graph(records.size(), FLAGS_map_file);
+  rs::calculate_similarity(records, &graph);
 
   vector<vector<int> > cluster_results;
-  rs::cluster(records, &cluster_results);
+  rs::cluster(graph.clusters(), &cluster_results);
   LOG(INFO) << "There are " << cluster_results.size() << " clusters.";
   rs::dump_result(records, cluster_results);
 }
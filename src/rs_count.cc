@@ -4,16 +4,18 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstdio>
-#include <fstream>
 #include <map>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "key_table.h"
 #include "proto_data.h"
 #include "fa_reader.h"
 #include "proto/rnasigs.pb.h"
@@ -22,8 +24,6 @@
 #include "rs_estimate_lib.h"
 #include "rolling_hash_counter.h"
 
-using std::fstream;
-using std::ios;
 using std::map;
 using std::string;
 using std::vector;
@@ -32,6 +32,11 @@ DEFINE_string(selected_keys_file, "",
               "The path to the selected keys file (input).");
 DEFINE_string(count_file, "",
               "The path to the file that contains all selected keys with their counts (output).");
+DEFINE_bool(counts_only, false,
+            "Whether to write only the counts of the keys (in the order "
+            "of the selected keys file) with the fingerprint of the "
+            "selected keys file, instead of all selected keys with their "
+            "counts. Such files are estimated by rs_estimate -count_files.");
 DEFINE_int32(num_threads, -1,
            "The num of threads used in the program. "
            "[default: -1]: the num of CPUs in the machine.");
@@ -45,23 +50,86 @@ DEFINE_bool(run_em, false,
            "Whether to run EM when counting.");
 DEFINE_bool(fastq, false,
            "Whether the data is fastq format");
+DEFINE_bool(mmap_reads, false,
+           "Whether to map the read files into memory, so that the reads "
+           "are processed in place without being copied.");
+DEFINE_bool(canonical_kmer, false,
+           "Whether to store only the canonical form (the smaller one of "
+           "a k-mer and its reverse complement) in the counter. This "
+           "halves the size of the counter, and gives the same counts.");
+DEFINE_bool(shard_counts, false,
+            "Whether every counting thread counts the keys in its own "
+            "array, which is merged when the thread finishes. This avoids "
+            "the atomic updates of the shared counters, but needs four "
+            "bytes per key per thread, and the EM thread only sees the "
+            "counts of the finished threads.");
+DEFINE_string(counter_index_file, "",
+              "The path to the compiled counter index of the selected "
+              "keys. If the file does not exist, the index is built from "
+              "the selected keys file and saved to it; otherwise it is "
+              "mapped into memory instead of being built again.");
+DEFINE_int32(decompress_threads, 4,
+             "The number of threads for decompressing every BGZF "
+             "compressed read file. Other gzip files are decompressed "
+             "by the reading thread.");
 
 namespace rs {
 
-void update_SelectedKey(const RollingHashCounter& counter, SelectedKey* sk) {
-  for (int i = 0; i < sk->keys_size(); i++) {
-    int count = 0;
-    string key = sk->keys(i).key();
+// The ids of the counter items whose counts are added up for a key.
+const int kKeySlots = 4;
 
-    count += counter.find(key);
+// Appends kKeySlots ids for every key of the selected key.
+void append_key_ids(const RollingHashCounter& counter, const SelectedKey& sk,
+                    vector<uint32_t>* key_ids) {
+  for (int i = 0; i < sk.keys_size(); i++) {
+    string key = sk.keys(i).key();
+    uint32_t key_id = counter.find_id(key);
+    key_ids->push_back(key_id);
+    if (counter.canonical()) {
+      // The reverse complement shares the count with the key, and so
+      // does the complement with the reversed key. The four forms of a
+      // palindromic key are only two items in the default mode, and
+      // each of them is added twice, so the counts here are the same:
+      // a key that is its own reversed key finds its item twice, and
+      // the items of a key that is its own reverse complement are
+      // added twice.
+      string reversed(key.rbegin(), key.rend());
+      uint32_t reversed_id = counter.find_id(reversed);
+      key_ids->push_back(reversed_id);
+      string reverse_complement = reversed;
+      compliment(&reverse_complement);
+      bool palindrome = reverse_complement == key;
+      key_ids->push_back(palindrome ? key_id : kEmptyItemId);
+      key_ids->push_back(palindrome ? reversed_id : kEmptyItemId);
+      continue;
+    }
     compliment(&key);
-    count += counter.find(key);
+    key_ids->push_back(counter.find_id(key));
     reverse(key.begin(), key.end());
-    count += counter.find(key);
+    key_ids->push_back(counter.find_id(key));
     compliment(&key);
-    count += counter.find(key);
+    key_ids->push_back(counter.find_id(key));
+  }
+}
+
+// Sets the counts of the keys by their ids, and returns the ids after
+// the ones of the selected key.
+const uint32_t* set_counts(const RollingHashCounter& counter,
+                           const uint32_t* key_ids, SelectedKey* sk) {
+  for (int i = 0; i < sk->keys_size(); i++) {
+    int count = 0;
+    for (int j = 0; j < kKeySlots; j++) {
+      count += counter.count(*key_ids++);
+    }
     sk->mutable_keys(i)->set_count(count);
   }
+  return key_ids;
+}
+
+void update_SelectedKey(const RollingHashCounter& counter, SelectedKey* sk) {
+  vector<uint32_t> key_ids;
+  append_key_ids(counter, *sk, &key_ids);
+  set_counts(counter, key_ids.data(), sk);
 }
 
 class CountThread : public ThreadInterface {
@@ -70,23 +138,27 @@ public:
     : reader_(reader), counter_(counter) {}
 
   void run() {
-    vector<string> reads1, reads2;
+    ReadBatch batch;
+    const vector<StringPiece>& reads1 = batch.reads1;
+    const vector<StringPiece>& reads2 = batch.reads2;
+    CountShard* shard = counter_->new_shard();
     int total = 0;
-    while (reader_->read(&reads1, &reads2) != 0) {
+    while (reader_->read(&batch) != 0) {
       for (uint32_t i = 0; i < reads1.size(); i++) {
         // since the counter contains all four different keys,
         // here, we only need to process the sequence once.
-        counter_->process(reads1[i]);
+        counter_->process(reads1[i], shard);
       }
       LOG(INFO) << "reads2.size() = " << reads2.size();
       // The only reason that reads1.size() != reads2.size() is that
       // the program is in the single read mode.
       for (uint32_t i = 0; i < reads2.size(); i++) {
-        counter_->process(reads2[i]);
+        counter_->process(reads2[i], shard);
       }
       total += reads1.size();
       //LOG(INFO) << "Processed " << total;
     }
+    counter_->merge(shard);
   }
 
 private:
@@ -166,57 +238,109 @@ public:
   CountMain(const string& index_file, const string& read_files1,
             const string& read_files2, int num_threads)
     : num_threads_(num_threads), index_file_(index_file),
-      read_files1_(read_files1), read_files2_(read_files2),
-      stream_(index_file, ios::in | ios::binary) {}
+      read_files1_(read_files1), read_files2_(read_files2) {}
 
   void run() {
-    int buffer_size = 200000000;
-    ::google::protobuf::uint8 * buffer =
-        new ::google::protobuf::uint8[buffer_size];
-    SelectedKey sk;
     vector<SelectedKey> selected_keys;
     vector<SelectedKey> selected_keys_for_em;
-    vector<string> keys;
-    LOG(INFO) << "Loading selected keys .. ";
-    LOG_IF(FATAL, !stream_.good()) << "Failed to open the index file"
-                                   << index_file_;
-    while(load_protobuf_data(&stream_, &sk, buffer, buffer_size)) {
-      for (int i = 0; i < sk.keys_size(); i++) {
-        string key = sk.keys(i).key();
-        keys.push_back(key);
-        // complimentary
-        compliment(&key);
-        keys.push_back(key);
+    RollingHashCounter* counter = nullptr;
+    // the ids of the keys in the order of the selected keys file
+    vector<uint32_t> built_key_ids;
+    const uint32_t* key_ids;
+    size_t num_key_ids;
+    // A counter index is only used with the selected keys file (and the
+    // rs_length) it is built from.
+    uint64_t keys_fingerprint = 0;
+    if (!FLAGS_counter_index_file.empty() || FLAGS_counts_only) {
+      keys_fingerprint = selected_keys_fingerprint(index_file_);
+    }
+    if (!FLAGS_counter_index_file.empty() &&
+        access(FLAGS_counter_index_file.c_str(), R_OK) == 0) {
+      LOG(INFO) << "Loading the counter index "
+                << FLAGS_counter_index_file;
+      counter = new RollingHashCounter(FLAGS_counter_index_file,
+                                       FLAGS_shard_counts);
+      LOG_IF(FATAL, counter->keys_fingerprint() != keys_fingerprint ||
+             (int)counter->key_length() != FLAGS_rs_length)
+        << "The counter index " << FLAGS_counter_index_file
+        << " is not built from " << index_file_ << " with -rs_length="
+        << FLAGS_rs_length << ", remove it to build it again.";
+      LOG_IF(WARNING, counter->canonical() != FLAGS_canonical_kmer)
+        << "-canonical_kmer is ignored, because the counter index is "
+        << (counter->canonical() ? "" : "not ") << "canonical.";
+      key_ids = counter->key_ids();
+      num_key_ids = counter->num_key_ids();
+    } else {
+      load_selected_keys(&selected_keys);
+      vector<string> keys;
+      for (auto& sk : selected_keys) {
+        for (int i = 0; i < sk.keys_size(); i++) {
+          string key = sk.keys(i).key();
+          keys.push_back(key);
+          if (FLAGS_canonical_kmer) {
+            // The selected key is the smallest one of its four forms, so
+            // we do not know which strand it comes from. The counter
+            // stores the canonical form of the key (for the key and its
+            // reverse complement) and of the reversed key (for the
+            // reversed key and the complementary key).
+            reverse(key.begin(), key.end());
+            keys.push_back(key);
+            continue;
+          }
+          // complimentary
+          compliment(&key);
+          keys.push_back(key);
 
-        // complimentary and reversed
-        reverse(key.begin(), key.end());
-        keys.push_back(key);
+          // complimentary and reversed
+          reverse(key.begin(), key.end());
+          keys.push_back(key);
 
-        // reversed
-        compliment(&key);
-        keys.push_back(key);
+          // reversed
+          compliment(&key);
+          keys.push_back(key);
+        }
       }
-      selected_keys.push_back(sk);
-      selected_keys_for_em.push_back(sk);
+      LOG(INFO) << "Building the index ...";
+      LOG(INFO) << "There are totally " << keys.size() << " keys";
+      counter = new RollingHashCounter(keys, 10, FLAGS_canonical_kmer,
+                                       FLAGS_shard_counts);
+      for (auto& sk : selected_keys) {
+        append_key_ids(*counter, sk, &built_key_ids);
+      }
+      if (!FLAGS_counter_index_file.empty()) {
+        LOG(INFO) << "Saving the counter index to "
+                  << FLAGS_counter_index_file;
+        counter->save(FLAGS_counter_index_file, built_key_ids,
+                      keys_fingerprint);
+      }
+      key_ids = built_key_ids.data();
+      num_key_ids = built_key_ids.size();
+    }
+    if (FLAGS_run_em) {
+      if (selected_keys.empty()) {
+        load_selected_keys(&selected_keys);
+      }
+      selected_keys_for_em = selected_keys;
     }
-    LOG(INFO) << "Building the index ...";
-    LOG(INFO) << "There are totally " << keys.size() << " keys";
-    RollingHashCounter counter(keys, 10);
     LOG(INFO) << "Counting the occurrences of the keys in the reads .. ";
     vector<string> fa_files1 = split_seq(read_files1_, ',');
     vector<string> fa_files2 = split_seq(read_files2_, ',');
     RSPairReader* reader_ = nullptr;
     if (FLAGS_fastq)
-        reader_ = new RSFastqPairReader(fa_files1, fa_files2);
+        reader_ = new RSFastqPairReader(fa_files1, fa_files2, 50000,
+                                        FLAGS_mmap_reads,
+                                        FLAGS_decompress_threads);
     else
-        reader_ = new RSPairReader(fa_files1, fa_files2);
+        reader_ = new RSPairReader(fa_files1, fa_files2, 50000,
+                                   FLAGS_mmap_reads,
+                                   FLAGS_decompress_threads);
     std::vector<std::thread> threads(num_threads_);
-    CountThread count_thread(reader_, &counter);
+    CountThread count_thread(reader_, counter);
     for (int i = 0; i < num_threads_; i ++) {
       threads[i] = std::thread{RSThread(&count_thread)};
     }
     std::atomic<bool> is_running (true);
-    EMThread em_thread(&counter, &selected_keys_for_em, &is_running);
+    EMThread em_thread(counter, &selected_keys_for_em, &is_running);
     std::thread em;
     if (FLAGS_run_em) {
       em = std::thread{RSThread(&em_thread)};
@@ -227,24 +351,74 @@ public:
       LOG(INFO) << "Notify other thread the counting is done.";
     }
     LOG(INFO) << "Dumping the results ...";
-    fstream ostream(FLAGS_count_file, ios::out | ios::binary | ios::trunc);
-    for (auto& sk : selected_keys) {
-      update_SelectedKey(counter, &sk);
-      write_protobuf_data(&ostream, &sk);
+    if (FLAGS_counts_only) {
+      vector<int32_t> counts;
+      sum_counts(*counter, key_ids, num_key_ids, &counts);
+      write_sample_counts(FLAGS_count_file, keys_fingerprint, counts);
+    } else if (KeyTable::is_key_table(index_file_)) {
+      vector<int32_t> counts;
+      sum_counts(*counter, key_ids, num_key_ids, &counts);
+      KeyTable::write_count_file(index_file_, FLAGS_count_file, counts);
+    } else {
+      dump_selected_keys(*counter, key_ids, num_key_ids, &selected_keys);
     }
     if (FLAGS_run_em) {
       em.join();
       em_thread.dump_result();
     }
-    counter.dump_info();
-    delete[] buffer;
+    counter->dump_info();
+    delete reader_;
+    delete counter;
   }
 private:
+  void load_selected_keys(vector<SelectedKey>* selected_keys) {
+    SelectedKey sk;
+    LOG(INFO) << "Loading selected keys .. ";
+    SelectedKeyReader reader(index_file_);
+    while(reader.read(&sk)) {
+      selected_keys->push_back(sk);
+    }
+  }
+
+  void dump_selected_keys(const RollingHashCounter& counter,
+                          const uint32_t* key_ids, size_t num_key_ids,
+                          vector<SelectedKey>* selected_keys) {
+    if (selected_keys->empty()) {
+      load_selected_keys(selected_keys);
+    }
+    ProtobufWriter writer(FLAGS_count_file);
+    const uint32_t* key_ids_end = key_ids + num_key_ids;
+    for (auto& sk : *selected_keys) {
+      LOG_IF(FATAL, key_ids + sk.keys_size() * kKeySlots > key_ids_end)
+        << "The counter index does not match the selected keys file.";
+      key_ids = set_counts(counter, key_ids, &sk);
+      writer.write(sk);
+    }
+    LOG_IF(FATAL, key_ids != key_ids_end)
+      << "The counter index does not match the selected keys file.";
+  }
+
+  // Sets the counts of the keys in the order of the selected keys file,
+  // which is the order of their ids, without loading the selected keys.
+  void sum_counts(const RollingHashCounter& counter,
+                  const uint32_t* key_ids, size_t num_key_ids,
+                  vector<int32_t>* counts) {
+    counts->resize(num_key_ids / kKeySlots);
+    LOG_IF(FATAL, counts->size() * kKeySlots != num_key_ids)
+      << "The counter index does not match the selected keys file.";
+    for (size_t i = 0; i < counts->size(); i++) {
+      int count = 0;
+      for (int j = 0; j < kKeySlots; j++) {
+        count += counter.count(*key_ids++);
+      }
+      (*counts)[i] = count;
+    }
+  }
+
   int num_threads_;
   string index_file_;
   string read_files1_;
   string read_files2_;
-  fstream stream_;
 };
 
 }  // namespace rs
@@ -1,5 +1,3 @@
-// TODO(zzj): make this program multithread
-
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -7,6 +5,7 @@
 #include <vector>
 #include <cmath>
 #include <algorithm>
+#include <omp.h>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
@@ -14,139 +13,148 @@
 #include "rs_common.h"
 #include "rs_estimate_lib.h"
 #include "proto/rnasigs.pb.h"
-#include "proto_data.h"
+#include "key_table.h"
 
-using std::cout;
-using std::endl;
-using std::fstream;
-using std::ios;
 using std::map;
 using std::string;
 using std::vector;
 
 DEFINE_string(count_file, "",
               "The path to the file that contains all selected keys with their counts (output).");
+DEFINE_string(selected_keys_file, "",
+              "The path to the selected keys file of the count files of "
+              "-count_files (input).");
+DEFINE_string(count_files, "",
+              "The count files of rs_count -counts_only, splitted by ','. "
+              "They are estimated together, and the estimation of every "
+              "count file is written to the count file with the "
+              "'.estimation' suffix.");
+DEFINE_int32(num_threads, 1,
+             "The num of threads used for estimating the count files of "
+             "-count_files.");
 DEFINE_int32(rs_length, 40,
            "The length of the sig-mer.");
 DEFINE_int32(read_length, 100,
            "The length of the RNA-seq reads.");
 
-#define DEBUG 0
-
 namespace rs {
   class EstimateMain {
   public:
-    EstimateMain(const string count_file)
-      : count_file_(count_file) {};
+    // The counts are the ones in the keys file if there are no count
+    // files.
+    EstimateMain(const string& keys_file, const vector<string>& count_files)
+      : keys_file_(keys_file), count_files_(count_files) {};
 
     void run() {
-      fstream istream(count_file_, ios::in | ios::binary);
+      uint64_t fingerprint = 0;
+      if (!count_files_.empty()) {
+        fingerprint = selected_keys_fingerprint(keys_file_);
+      }
+      vector<SampleCounts*> samples;
+      for (auto& count_file : count_files_) {
+        samples.push_back(new SampleCounts(count_file));
+        LOG_IF(FATAL, samples.back()->fingerprint() != fingerprint)
+          << count_file << " is not counted with " << keys_file_;
+      }
+      SelectedKeyReader reader(keys_file_);
       SelectedKey sk;
-      int buffer_size = 200000000;
-      ::google::protobuf::uint8 * buffer =
-          new ::google::protobuf::uint8[buffer_size];
-      map<string, double> profile;
-      map<string, int> tid2length;
-      while(load_protobuf_data(&istream, &sk, buffer, buffer_size)) {
-        // a table from a transcript id to a vector of estimated
-        // abundunce values.
-
-        bool debug = false;
-        int inspected_tid = 0;
+      // the transcripts are numbered when they are first read, and the
+      // estimation of a transcript in a later gene replaces the earlier
+      // one.
+      map<string, int> tid_index;
+      vector<int> lengths;
+      vector<vector<double> > profiles(std::max<size_t>(samples.size(), 1));
+      vector<int32_t> counts;
+      uint64_t num_keys = 0;
+      while(reader.read(&sk)) {
+        vector<int> tids(sk.tids_size());
         for (int i = 0; i < sk.tids_size(); i++) {
-          tid2length[sk.tids(i)] = sk.lengths(i);
-          // if (sk.tids(i) == "ENSMUST00000129709") {
-          if (sk.tids(i) == "ENSMUST00000114890") {
-            debug = true;
-            inspected_tid = i;
+          auto iter = tid_index.insert(std::make_pair(sk.tids(i),
+                                                      lengths.size()));
+          if (iter.second) {
+            lengths.push_back(0);
+            for (auto& profile : profiles) {
+              profile.push_back(0);
+            }
           }
+          tids[i] = iter.first->second;
+          lengths[tids[i]] = sk.lengths(i);
         }
-        if (DEBUG && !debug) continue;
         LOG_IF(ERROR, sk.tids_size() > 100) << "Preparing";
-
-        SignatureInfoDB db;
-        bool run_em = prepare_SignatureInfoDB(sk, &db);
-
-        vector<vector<int> > covered_transcripts; // = find_covered_transcript(db, sk.tids_size());
-        vector<double> density_per_tid(sk.tids_size());
+        // The transcripts of the keys are the same for all samples.
+        GeneModel model(sk);
         LOG_IF(ERROR, sk.tids_size() > 100) << "Start EM";
-        if (run_em) {
-          vector<double> pi(sk.tids_size(), 1.0 / sk.tids_size());
-          EM(sk.tids_size(), db, &density_per_tid, &pi);
-          // bool penalized_run = false;
-          // vector<double>  penalty(sk.tids_size(), 1);
-          // for (int i = 0; i < (int) covered_transcripts.size(); i++) {
-          //   if (covered_transcripts[i].size() == 0) continue;
-          //   if (density_per_tid[i] > 0) {
-          //     penalized_run = true;
-          //     for (int j : covered_transcripts[i]) {
-          //       penalty[j] *= 5;
-          //     }
-          //   }
-          // }
-          // if (penalized_run) {
-          //   SignatureInfoDB new_db;
-          //   for (const auto& item : db) {
-          //     vector<double> w = item.first;
-          //     for (int i= 0; i < sk.tids_size(); i++) {
-          //       w[i] *= penalty[i];
-          //     }
-          //     new_db[w] = item.second;
-          //   }
-          //   density_per_tid = EM(sk.tids_size(), new_db);
-          // }
-        }
-        vector<double> num_reads(sk.tids_size(), 0);
-        for (int j = 0; j < sk.tids_size(); j++) {
-          num_reads[j] = density_per_tid[j] * (sk.lengths(j));
-        }
-        for (int j = 0; j < sk.tids_size(); j++) {
-          if (num_reads[j] < 0.1) num_reads[j] = 0;
-        }
-        if (DEBUG) {
-          for (size_t i = 0; i <  covered_transcripts.size(); i++) {
-            if (covered_transcripts[i].size() == 0) continue;
-            cout << sk.tids(i) << " covers ";
-              for (size_t j = 0; j < covered_transcripts[i].size(); j++) {
-                cout << sk.tids(covered_transcripts[i][j]) << ' ';
-              }
-              cout << endl;
+        if (samples.empty()) {
+          counts.clear();
+          for (int i = 0; i < sk.keys_size(); i++) {
+            counts.push_back(sk.keys(i).count());
+          }
+          set_profile(model, counts.data(), tids, &profiles[0]);
+        } else {
+          for (size_t s = 0; s < samples.size(); s++) {
+            LOG_IF(FATAL, num_keys + sk.keys_size() > samples[s]->num_keys())
+              << count_files_[s] << " has fewer keys than " << keys_file_;
+          }
+          #pragma omp parallel for schedule(dynamic)
+          for (size_t s = 0; s < samples.size(); s++) {
+            set_profile(model, samples[s]->counts() + num_keys, tids,
+                        &profiles[s]);
           }
         }
-        for (size_t j = 0; j < num_reads.size(); j++) {
-          profile[sk.tids(j)] = num_reads[j];
-        }
+        num_keys += sk.keys_size();
+      }
+      if (samples.empty()) {
+        write_profile(tid_index, lengths, &profiles[0], &std::cout);
+        return;
+      }
+      for (size_t s = 0; s < samples.size(); s++) {
+        LOG_IF(FATAL, num_keys != samples[s]->num_keys())
+          << count_files_[s] << " has more keys than " << keys_file_;
+        string estimation_file = count_files_[s] + ".estimation";
+        std::ofstream out(estimation_file.c_str());
+        LOG_IF(FATAL, !out.good()) << "Failed to open " << estimation_file;
+        write_profile(tid_index, lengths, &profiles[s], &out);
+        LOG_IF(FATAL, !out.good()) << "Failed to write " << estimation_file;
+        delete samples[s];
+      }
+    }
+
+  private:
+    void set_profile(const GeneModel& model, const int32_t* counts,
+                     const vector<int>& tids, vector<double>* profile) {
+      vector<double> num_reads;
+      model.estimate(counts, &num_reads);
+      for (size_t j = 0; j < num_reads.size(); j++) {
+        (*profile)[tids[j]] = num_reads[j];
       }
+    }
+
+    void write_profile(const map<string, int>& tid_index,
+                       const vector<int>& lengths, vector<double>* profile,
+                       std::ostream* out) {
       double estimated_total_reads = 0;
       double estimated_total_abundance = 0;
-      for (auto& iter : profile) {
-        iter.second /= FLAGS_read_length;
-        iter.second =
-            iter.second * FLAGS_read_length / (FLAGS_read_length - FLAGS_rs_length);
-        estimated_total_reads += iter.second;
-        estimated_total_abundance += iter.second / tid2length[iter.first];
+      for (auto& iter : tid_index) {
+        double& reads = (*profile)[iter.second];
+        reads /= FLAGS_read_length;
+        reads = reads * FLAGS_read_length / (FLAGS_read_length - FLAGS_rs_length);
+        estimated_total_reads += reads;
+        estimated_total_abundance += reads / lengths[iter.second];
       }
       LOG(ERROR) << "Estimated total reads " << estimated_total_reads;
-      for (auto iter : profile) {
-        double rpkm = 0;
-        double tpm = 0;
-        int length = 0;
-        if (tid2length.find(iter.first) != tid2length.end()) {
-          rpkm = iter.second / (tid2length[iter.first] / 1000.0) / (estimated_total_reads / 1000000.0);
-          // the sum of tpm is 1 million
-          tpm = iter.second / tid2length[iter.first] / estimated_total_abundance * 1000000;
-          length = tid2length[iter.first];
-        }
-        std::cout << iter.first << '\t' << length << '\t'
-                  << iter.second << '\t' << rpkm << '\t' << tpm << std::endl;
-        // for (auto v : iter.second) {
-        //   cout << v << '\t';
-        // }
-        // cout << endl;
+      for (auto& iter : tid_index) {
+        double reads = (*profile)[iter.second];
+        int length = lengths[iter.second];
+        double rpkm = reads / (length / 1000.0) / (estimated_total_reads / 1000000.0);
+        // the sum of tpm is 1 million
+        double tpm = reads / length / estimated_total_abundance * 1000000;
+        (*out) << iter.first << '\t' << length << '\t'
+               << reads << '\t' << rpkm << '\t' << tpm << '\n';
       }
     }
-  private:
-    string count_file_;
+
+    string keys_file_;
+    vector<string> count_files_;
   };
 }  // namespace rs
 
@@ -154,6 +162,15 @@ namespace rs {
 int main(int argc, char *argv[]) {
   google::InitGoogleLogging(argv[0]);
   google::ParseCommandLineFlags(&argc, &argv, true);
-  rs::EstimateMain em(FLAGS_count_file);
-  em.run();
+  omp_set_num_threads(FLAGS_num_threads);
+  if (FLAGS_count_files.empty()) {
+    rs::EstimateMain em(FLAGS_count_file, vector<string>());
+    em.run();
+  } else {
+    LOG_IF(FATAL, FLAGS_selected_keys_file.empty())
+      << "-selected_keys_file is needed for -count_files";
+    rs::EstimateMain em(FLAGS_selected_keys_file,
+                        rs::split_seq(FLAGS_count_files, ','));
+    em.run();
+  }
 }
@@ -152,28 +152,47 @@ namespace rs{
     return target;
   }
 
-  void EM(int num_tids, const SignatureInfoDB& db,
-          vector<double>* count_per_tid, vector<double>* pi) {
-    vector<double> new_pi;
-    int niter = 0;
-    count_per_tid->resize(num_tids, 0);
-    vector<double> num_kmers(num_tids, 0);
-    // if has_weight[key_id][0] is tid, it means the tid contains
-    // the key_id. The spars
-    vector<vector<int> > key2tids(db.size());
-
+  void prepare_EMModel(int num_tids, const SignatureInfoDB& db,
+                       EMModel* model) {
+    model->num_tids = num_tids;
+    model->weights.clear();
+    model->occurences.clear();
+    model->key2tids.assign(db.size(), vector<int>());
+    model->num_kmers.assign(num_tids, 0);
     int item_id = 0;
     for (const auto& item : db) {
       const vector<double>& weights = item.first;
       for (int i = 0; i < num_tids; i++) {
         if (weights[i] > 0) {
-          key2tids[item_id].push_back(i);
-          num_kmers[i] += weights[i] * item.second.occurences;
+          model->key2tids[item_id].push_back(i);
+          model->num_kmers[i] += weights[i] * item.second.occurences;
         }
       }
+      model->weights.push_back(weights);
+      model->occurences.push_back(item.second.occurences);
       item_id ++;
     }
-    double target = target_value(db, *pi, num_kmers);
+  }
+
+  void EM(int num_tids, const SignatureInfoDB& db,
+          vector<double>* count_per_tid, vector<double>* pi) {
+    EMModel model;
+    prepare_EMModel(num_tids, db, &model);
+    vector<int> counts;
+    for (const auto& item : db) {
+      counts.push_back(item.second.total_counts);
+    }
+    EM(model, counts, count_per_tid, pi);
+  }
+
+  void EM(const EMModel& model, const vector<int>& counts,
+          vector<double>* count_per_tid, vector<double>* pi) {
+    int num_tids = model.num_tids;
+    const vector<double>& num_kmers = model.num_kmers;
+    const vector<vector<int> >& key2tids = model.key2tids;
+    vector<double> new_pi;
+    int niter = 0;
+    count_per_tid->resize(num_tids, 0);
 
     while (true) {
       // resize only set default value for the new variables
@@ -182,19 +201,18 @@ namespace rs{
       count_per_tid->resize(0);
       count_per_tid->resize(num_tids, 0);
 
-      int item_id = 0;
-      for (const auto& item : db) {
-        const vector<double>& weights = item.first;
+      for (size_t item_id = 0; item_id < key2tids.size(); item_id++) {
+        const vector<double>& weights = model.weights[item_id];
         vector<double> new_pi_tid(key2tids[item_id].size(), 0);
 
         for (size_t i = 0; i < new_pi_tid.size(); i++) {
           int tid = key2tids[item_id][i];
           if (num_kmers[tid] != 0) {
-            new_pi_tid[i] = weights[tid] * pi->at(tid) * item.second.occurences / num_kmers[tid];
+            new_pi_tid[i] = weights[tid] * pi->at(tid) * model.occurences[item_id] / num_kmers[tid];
           }
         }
         new_pi_tid = normalize(new_pi_tid);
-        int count = item.second.total_counts;
+        int count = counts[item_id];
         for (size_t i = 0; i < new_pi_tid.size(); i++) {
           int tid = key2tids[item_id][i];
           count_per_tid->at(tid) += count * new_pi_tid[i];
@@ -212,7 +230,6 @@ namespace rs{
           }
           cout << '\n';
         }
-        item_id ++;
       }
       for (int i = 0; i < num_tids; i++) {
         if (num_kmers[i] == 0) {
@@ -228,8 +245,6 @@ namespace rs{
 
       new_pi = normalize(*count_per_tid);
 
-      double new_target = 0;
-
       // new_target = target_value(db, new_pi, num_kmers);
       // *pi = new_pi;
       // if (new_target - target < 0) {
@@ -250,7 +265,6 @@ namespace rs{
       if (diff < 0.0000000001) {
         break;
       }
-      target = new_target;
       niter ++;
       if (niter > 500000) break;
       // LOG_IF(ERROR, num_tids > 100) << niter;
@@ -261,10 +275,7 @@ namespace rs{
     }
     *pi = normalize(*count_per_tid);
     if (DEBUG) {
-      for (const auto& kv : db) {
-        int count = kv.second.total_counts;
-        // const vector<double>& weights = kv.first;
-        // debug_vector(weights);
+      for (int count : counts) {
         cout << count << endl;
       }
       debug_vector(new_pi);
@@ -272,27 +283,27 @@ namespace rs{
     return ;
   }
 
+  // the weights of the ith key in the transcripts of the gene
+  vector<double> key_weights(const SelectedKey &sk, int i) {
+    auto& key = sk.keys(i);
+    vector<double> weights(sk.tids_size(), 0);
+    for (int j = 0; j < key.transcript_infos_size(); j ++) {
+      auto & info = key.transcript_infos(j);
+      vector<int> pos;
+      for (auto p : info.positions()) {
+        pos.push_back(p);
+      }
+      weights[info.tidx()] +=
+        weight_of_kmer(sk.lengths(info.tidx()), pos);
+    }
+    return weights;
+  }
+
   bool prepare_SignatureInfoDB(const SelectedKey &sk, SignatureInfoDB *db) {
     bool run_em = false;
     for (int i = 0; i < sk.keys_size(); i++) {
       auto& key = sk.keys(i);
-      set<string> tids;
-      vector<double> weights(sk.tids_size(), 0);
-
-      for (int j = 0; j < key.transcript_infos_size(); j ++) {
-        auto & info = key.transcript_infos(j);
-        tids.insert(sk.tids(info.tidx()));
-        vector<int> pos;
-        for (auto p : info.positions()) {
-          pos.push_back(p);
-        }
-        weights[info.tidx()] +=
-          weight_of_kmer(sk.lengths(info.tidx()), pos);
-
-        // cout << sk.tids(info.tidx()) << endl;
-        // cout << key.key() << endl;
-        // cout << key.count() << endl;
-      }
+      vector<double> weights = key_weights(sk, i);
       auto iter = db->find(weights);
       if (iter != db->end()) {
         iter->second.total_counts += key.count();
@@ -313,4 +324,47 @@ namespace rs{
     }
     return run_em;
   }
+
+  GeneModel::GeneModel(const SelectedKey& sk) {
+    SignatureInfoDB db;
+    vector<vector<double> > weights(sk.keys_size());
+    for (int i = 0; i < sk.keys_size(); i++) {
+      weights[i] = key_weights(sk, i);
+      SignatureInfo& si = db[weights[i]];
+      si.total_counts = 0;
+      si.occurences += 1;
+    }
+    prepare_EMModel(sk.tids_size(), db, &model_);
+    map<vector<double>, int> items;
+    for (size_t i = 0; i < model_.weights.size(); i++) {
+      items[model_.weights[i]] = i;
+    }
+    for (auto& w : weights) {
+      key_items_.push_back(items[w]);
+    }
+    lengths_.assign(sk.lengths().begin(), sk.lengths().end());
+  }
+
+  void GeneModel::estimate(const int32_t* counts,
+                           vector<double>* num_reads) const {
+    int num_tids = model_.num_tids;
+    vector<int> item_counts(model_.weights.size(), 0);
+    bool run_em = false;
+    for (size_t i = 0; i < key_items_.size(); i++) {
+      item_counts[key_items_[i]] += counts[i];
+      if (counts[i] != 0) {
+        run_em = true;
+      }
+    }
+    vector<double> density_per_tid(num_tids);
+    if (run_em) {
+      vector<double> pi(num_tids, 1.0 / num_tids);
+      EM(model_, item_counts, &density_per_tid, &pi);
+    }
+    num_reads->assign(num_tids, 0);
+    for (int j = 0; j < num_tids; j++) {
+      (*num_reads)[j] = density_per_tid[j] * lengths_[j];
+      if ((*num_reads)[j] < 0.1) (*num_reads)[j] = 0;
+    }
+  }
 } // namespace rs
@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <vector>
 #include <map>
 
@@ -18,8 +19,45 @@ namespace rs {
 
   typedef map<vector<double>, SignatureInfo> SignatureInfoDB;
 
+  // The part of the EM algorithm that only depends on the transcripts of
+  // the keys (not on their counts), in the order of the SignatureInfoDB.
+  class EMModel {
+  public:
+    int num_tids;
+    vector<vector<double> > weights;
+    vector<int> occurences;
+    // the transcripts of every item of the SignatureInfoDB
+    vector<vector<int> > key2tids;
+    vector<double> num_kmers;
+  };
+
+  void prepare_EMModel(int num_tids, const SignatureInfoDB& db,
+                       EMModel* model);
+
+  // counts are the total counts of the items of the model.
+  void EM(const EMModel& model, const vector<int>& counts,
+          vector<double>* count_per_tid, vector<double>* pi);
+
   void EM(int num_tids, const SignatureInfoDB& db,
           vector<double>* count_per_tid, vector<double>* pi);
 
   bool prepare_SignatureInfoDB(const SelectedKey &sk, SignatureInfoDB *db);
+
+  // The keys of a gene grouped by their transcripts, which is the same
+  // for all samples counted with the same selected keys.
+  class GeneModel {
+  public:
+    explicit GeneModel(const SelectedKey& sk);
+
+    // Sets num_reads to the estimated number of reads of every
+    // transcript, from the counts of the keys of the gene (in the order
+    // of sk.keys).
+    void estimate(const int32_t* counts, vector<double>* num_reads) const;
+
+  private:
+    EMModel model_;
+    // the item of the model of every key
+    vector<int> key_items_;
+    vector<int> lengths_;
+  };
 } // namesapce
@@ -1,8 +1,9 @@
 // This file is the main file for indexing all RNA signatures.
 
 #include <algorithm>
+#include <condition_variable>
 #include <cstdio>
-#include <fstream>
+#include <deque>
 #include <map>
 #include <mutex>
 #include <string>
@@ -14,6 +15,11 @@
 
 #include "proto_data.h"
 #include "fa_reader.h"
+#include "cyclic_hash.h"
+#include "kmer_hash_set.h"
+#include "kmer_partitions.h"
+#include "packed_kmer.h"
+#include "packed_transcriptome.h"
 #include "proto/rnasigs.pb.h"
 #include "rs_bloom.h"
 #include "rs_common.h"
@@ -22,8 +28,6 @@
 using std::string;
 using std::pair;
 using std::vector;
-using std::fstream;
-using std::ios;
 
 DEFINE_string(transcript_fasta, "",
               "The fasta file for transcript sequences of every gene. This is suggested to use the output of rs_cluster. We use a specialized FASTA format, in which each line represents a gene and its transcripts.  A transcript sequence per line is not recommended. ");
@@ -34,27 +38,56 @@ DEFINE_int32(num_threads, -1,
            "[default: -1]: the num of CPUs in the machine.");
 DEFINE_int32(rs_length, 40,
            "The length of the RS signature.");
+DEFINE_bool(blocked_bloom, false,
+            "Whether to use the blocked bloom filters, which keep all the "
+            "bits of a k-mer in one cache line. They are faster but use "
+            "25% more memory.");
+DEFINE_bool(exact_kmers, false,
+            "Whether to find the k-mers shared by the genes exactly, by "
+            "sorting the partitions of the k-mers, instead of with the bloom "
+            "filters, whose false positives drop some signatures. The "
+            "rs_length must be no more than 64.");
+DEFINE_int32(kmer_partitions, 256,
+             "The number of the partitions of the k-mers with -exact_kmers.");
+DEFINE_string(kmer_partition_dir, "",
+              "The directory of the partition files with -exact_kmers, so "
+              "that only the partitions being sorted are in memory. The "
+              "partitions are kept in memory if it is empty.");
 
 
 namespace rs {
 
-// This thread gets all duplicated substrings in a bloom.
+// This thread gets all duplicated substrings in a bloom. The k-mers are
+// given to the blooms (and the set of the k-mers of the gene) by their
+// rolling hash values.
 class IndexThread : public ThreadInterface {
 public:
-  IndexThread(SingleFastaReader* reader, RSBloom* all_bloom, RSBloom* dup_bloom)
-    : reader_(reader), all_bloom_(all_bloom), dup_bloom_(dup_bloom) {}
-
-  void add(const string& seq, RSBloom* line_bloom) {
-    for (int start = 0; start < (int)seq.size() - FLAGS_rs_length;
+  IndexThread(SingleFastaReader* reader, PackedTranscriptome* transcriptome,
+              RSBloom* all_bloom, RSBloom* dup_bloom)
+    : reader_(reader), transcriptome_(transcriptome), all_bloom_(all_bloom),
+      dup_bloom_(dup_bloom) {}
+
+  // The k-mers are hashed in their canonical orientation, so adding
+  // the seq once is the same as adding it in all the four orientations
+  // (normal, complimentary, reversed, and both).
+  void add(const string& seq, KmerHashSet* line_set,
+           CanonicalCyclicHash* hasher) {
+    if ((int)seq.size() < FLAGS_rs_length) return;
+    uint64_t hashvalue =
+        hasher->hash(StringPiece(seq.data(), FLAGS_rs_length));
+    for (int start = 0; start <= (int)seq.size() - FLAGS_rs_length;
          start ++) {
-      StringPiece temp(seq.data() + start, FLAGS_rs_length);
+      if (start > 0) {
+        hashvalue = hasher->update(seq[start + FLAGS_rs_length - 1],
+                                   seq[start - 1]);
+      }
       // This is the first rs signature in this gene.
 
-      if (line_bloom->add(temp)) {
+      if (line_set->insert(hashvalue)) {
         // This is NOT the first  rs signature in this scan.
-        if (!all_bloom_->add(temp)) {
+        if (!all_bloom_->add_hash(hashvalue)) {
           // add to the duplicated set
-          dup_bloom_->add(temp);
+          dup_bloom_->add_hash(hashvalue);
         }
       }
     }
@@ -62,168 +95,338 @@ public:
 
   void run() {
     vector<string> ids, seqs;
+    // the k-mers of the current gene, which is reused for all the genes
+    // of the thread
+    KmerHashSet line_set;
+    CanonicalCyclicHash hasher(FLAGS_rs_length);
 
-    while (reader_->read(&ids, &seqs) != 0) {
+    size_t first_gene;
+    while (reader_->read(&ids, &seqs, &first_gene) != 0) {
       for (size_t i = 0; i < ids.size(); i++) {
         string whole_seq = seqs[i];
-        // TODO(zzj): memory leak, need to figure out why it crashes
-        // when the whole_seq size is huge (e.g. 17M)
-        RSBloom *rsb = new RSBloom(whole_seq.size() * 4, 0.001);
+        line_set.clear();
         vector<string> seqs = split_seq(whole_seq, '|');
+        transcriptome_->add(first_gene + i, ids[i], seqs);
         for (auto& seq : seqs) {
+          add(seq, &line_set, &hasher);
+        }
+      }
+    }
+  }
 
-          // add four different possible sequences into bloom
-          // normal
-          add(seq, rsb);
-
-          // complimentary
-          compliment(&seq);
-          add(seq, rsb);
+private:
+  SingleFastaReader* reader_;
+  PackedTranscriptome* transcriptome_;
+  RSBloom* all_bloom_;
+  RSBloom* dup_bloom_;
+};
 
-          // complimentary and reversed
-          reverse(seq.begin(), seq.end());
-          add(seq, rsb);
+// This thread adds the k-mers of every gene to the partitions, which
+// find the k-mers in more than one gene exactly.
+class PartitionKmerThread : public ThreadInterface {
+public:
+  // This is not run if partitions is nullptr (without -exact_kmers),
+  // and then rs_length may be more than 64.
+  PartitionKmerThread(SingleFastaReader* reader,
+                      PackedTranscriptome* transcriptome,
+                      KmerPartitions* partitions)
+    : reader_(reader), transcriptome_(transcriptome), partitions_(partitions),
+      codec_(partitions == nullptr ? 1 : FLAGS_rs_length) {}
 
-          // reversed and normal
-          compliment(&seq);
-          add(seq, rsb);
+  void run() {
+    vector<string> ids, seqs;
+    vector<PackedKmer> kmers;
+    size_t first_gene;
+    while (reader_->read(&ids, &seqs, &first_gene) != 0) {
+      for (size_t i = 0; i < ids.size(); i++) {
+        kmers.clear();
+        vector<string> gene_seqs = split_seq(seqs[i], '|');
+        transcriptome_->add(first_gene + i, ids[i], gene_seqs);
+        for (auto& seq : gene_seqs) {
+          for_each_kmer(codec_, seq, [&kmers](int, const PackedKmer& kmer) {
+              kmers.push_back(kmer);
+            });
         }
+        // a k-mer is added once for every gene
+        std::sort(kmers.begin(), kmers.end());
+        kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+        partitions_->add(kmers);
       }
     }
   }
 
 private:
   SingleFastaReader* reader_;
-  RSBloom* all_bloom_;
-  RSBloom* dup_bloom_;
+  PackedTranscriptome* transcriptome_;
+  KmerPartitions* partitions_;
+  KmerCodec codec_;
 };
 
-// This class is used for dumping the data into a file
+// This class is used for dumping the data into a file, in the order of
+// the genes in the transcriptome, so the index is the same in every
+// run. It also gives the transcripts to the lookup threads one by one,
+// so the transcripts of a large gene are looked up by many threads.
+// A gene is written by write_all when all its transcripts are done, and
+// the threads only look up the transcripts of the next max_pending
+// genes, so the genes waiting to be written are bounded.
 // This is thread safe
 // This should be used as a singleton.
 class IndexDumper {
 public:
-  IndexDumper(const string& filename)
-    : stream_(filename, ios::out | ios::binary | ios::trunc) {
+  IndexDumper(const string& filename,
+              const PackedTranscriptome* transcriptome, size_t max_pending)
+    : writer_(filename),
+      transcriptome_(transcriptome), max_pending_(max_pending),
+      next_write_(0), next_gene_(0), next_transcript_(0) {
   }
-  void dump(const vector<GeneSignatures>& data) {
+
+  // Sets the next transcript to look up, and returns false if all the
+  // transcripts are given out. This blocks if the gene of the transcript
+  // is too far ahead of the genes written.
+  bool next_transcript(size_t* gene, size_t* transcript) {
+    std::unique_lock<std::mutex> lock(m_);
+    while (next_gene_ < transcriptome_->size() &&
+           next_transcript_ >=
+           transcriptome_->gene(next_gene_).transcripts.size()) {
+      next_gene_++;
+      next_transcript_ = 0;
+    }
+    if (next_gene_ >= transcriptome_->size()) return false;
+    *gene = next_gene_;
+    *transcript = next_transcript_++;
+    space_ready_.wait(lock, [this, gene] {
+        return *gene < next_write_ + max_pending_;
+      });
+    pending(*gene);
+    return true;
+  }
+
+  // Sets the signatures of the transcript of the gene, which are
+  // swapped out of signatures.
+  void dump(size_t gene, size_t transcript,
+            GeneSignatures::TranscriptSignatures* signatures) {
     std::lock_guard<std::mutex> lock(m_);
-    for (auto& s : data) {
-      write_protobuf_data(&stream_, &s);
+    PendingGene* p = pending(gene);
+    signatures->set_id(transcript + 1 < p->ids.size() ?
+                       p->ids[transcript + 1] : "");
+    p->signatures.mutable_transcripts(transcript)->Swap(signatures);
+    if (--p->remaining == 0) {
+      gene_ready_.notify_one();
+    }
+  }
+
+  // Writes all the genes in order, while they are looked up by the
+  // other threads.
+  void write_all() {
+    for (size_t gene = 0; gene < transcriptome_->size(); gene++) {
+      GeneSignatures signatures;
+      {
+        std::unique_lock<std::mutex> lock(m_);
+        gene_ready_.wait(lock, [this, gene] {
+            return pending(gene)->remaining == 0;
+          });
+        signatures.Swap(&pending_.front().signatures);
+        pending_.pop_front();
+        next_write_++;
+      }
+      space_ready_.notify_all();
+      writer_.write(signatures);
     }
   }
+
 private:
-  fstream stream_;
+  struct PendingGene {
+    GeneSignatures signatures;
+    // first one is the gene id, the remaining ones are transcript ids.
+    vector<string> ids;
+    // the number of the transcripts not looked up
+    size_t remaining;
+  };
+
+  // Returns the pending gene, which is added (with the ones before it)
+  // if it is not yet. m_ must be locked.
+  PendingGene* pending(size_t gene) {
+    while (pending_.size() <= gene - next_write_) {
+      const PackedGene& packed =
+          transcriptome_->gene(next_write_ + pending_.size());
+      pending_.push_back(PendingGene());
+      PendingGene& p = pending_.back();
+      p.ids = split_seq(packed.header, '|');
+      if (p.ids.size() != packed.transcripts.size() + 1) {
+        LOG(ERROR) << "Wrong format for header: " << packed.header;
+        LOG(ERROR) << p.ids.size() << " " << packed.transcripts.size();
+      }
+      p.signatures.set_id(p.ids[0]);
+      for (size_t i = 0; i < packed.transcripts.size(); i++) {
+        p.signatures.add_transcripts();
+      }
+      p.remaining = packed.transcripts.size();
+    }
+    return &pending_[gene - next_write_];
+  }
+
+  ProtobufWriter writer_;
+  const PackedTranscriptome* transcriptome_;
+  size_t max_pending_;
+  // the genes from next_write_, which are not written
+  std::deque<PendingGene> pending_;
+  size_t next_write_;
+  // the next transcript to look up
+  size_t next_gene_;
+  size_t next_transcript_;
   std::mutex m_;
+  std::condition_variable gene_ready_;
+  std::condition_variable space_ready_;
 };
 
 // This thread runs after the IndexThread and will find out all unique
-// strings of the transcripts.
+// strings of the transcripts, which are kept in memory by the
+// IndexThread, so the fasta file is not read again.
 class LookupUniqueStringThread : public ThreadInterface {
 public:
-  LookupUniqueStringThread(SingleFastaReader* reader, RSBloom* dup_bloom,
+  // Only one of dup_bloom and partitions is used, and the other one
+  // is nullptr.
+  LookupUniqueStringThread(const PackedTranscriptome* transcriptome,
+                           RSBloom* dup_bloom,
+                           const KmerPartitions* partitions,
                            IndexDumper* dumper)
-    : reader_(reader), dup_bloom_(dup_bloom), dumper_(dumper) {}
-
-  void run() {
-    vector<string> ids, seqs;
-    while(reader_->read(&ids, &seqs) != 0) {
-      for (size_t i = 0; i < ids.size(); i++) {
-        string whole_seq = seqs[i];
-        string header = ids[i];
-
-        // first one is the gene id, the remaining ones are transcript ids.
-        vector<string> ids = split_seq(header, '|');
-        vector<string> seqs = split_seq(whole_seq, '|');
-        if (ids.size() != seqs.size() + 1) {
-          LOG(ERROR) << "Wrong format for header: " << header;
-          LOG(ERROR) << ids.size() << " " << seqs.size();
+    : transcriptome_(transcriptome), dup_bloom_(dup_bloom),
+      partitions_(partitions), dumper_(dumper),
+      codec_(partitions == nullptr ? 1 : FLAGS_rs_length),
+      hasher_(FLAGS_rs_length) {}
+
+  // Sets (*dup)[start] for every k-mer starting at start in the seq,
+  // which is true iff the k-mer is in more than one gene.
+  void find_duplicates(const string& seq, vector<bool>* dup) {
+    if (partitions_ == nullptr) {
+      dup->assign(seq.size(), false);
+      if ((int)seq.size() <= FLAGS_rs_length) return;
+      uint64_t hashvalue =
+          hasher_.hash(StringPiece(seq.data(), FLAGS_rs_length));
+      for (int start = 0; start < (int)seq.size() - FLAGS_rs_length;
+           start ++) {
+        if (start > 0) {
+          hashvalue = hasher_.update(seq[start + FLAGS_rs_length - 1],
+                                     seq[start - 1]);
         }
+        (*dup)[start] = dup_bloom_->contain_hash(hashvalue);
+      }
+      return;
+    }
+    partitions_->find_duplicates(codec_, seq, dup);
+  }
 
-        GeneSignatures result;
-        result.set_id(ids[0]);
-        for (size_t i = 0; i < seqs.size(); i++) {
-          auto& seq = seqs[i];
-          auto transcript = result.add_transcripts();
-          transcript->set_id(ids[i + 1]);
-          transcript->set_length(seq.size());
-          bool is_consecutive = false;
-          int last_start = -1;
-          for (int start = 0; start < (int)seq.size() - FLAGS_rs_length;
-               start ++) {
-            StringPiece temp (seq.data() + start, FLAGS_rs_length);
-            if (!dup_bloom_->contain(temp)) {
-              if (!is_consecutive) {
-                // record the first position of the consecutive region
-                last_start = start;
-              }
-              is_consecutive = true;
-            } else {
-              if (is_consecutive) {
-                // save the current consecutive region
-                auto meta = transcript->add_signatures();
-                meta->set_seq(seq.substr(last_start,
-                                         start - last_start + FLAGS_rs_length));
-                meta->set_position(last_start);
-              }
-              is_consecutive = false;
-            }
+  void run() {
+    string seq;
+    vector<bool> dup;
+    size_t g, t;
+    while (dumper_->next_transcript(&g, &t)) {
+      transcriptome_->gene(g).transcripts[t].decode(&seq);
+      GeneSignatures::TranscriptSignatures transcript;
+      transcript.set_length(seq.size());
+      bool is_consecutive = false;
+      int last_start = -1;
+      find_duplicates(seq, &dup);
+      for (int start = 0; start < (int)seq.size() - FLAGS_rs_length;
+           start ++) {
+        if (!dup[start]) {
+          if (!is_consecutive) {
+            // record the first position of the consecutive region
+            last_start = start;
           }
+          is_consecutive = true;
+        } else {
           if (is_consecutive) {
-            auto meta = transcript->add_signatures();
-            meta->set_seq(seq.substr(last_start));
+            // save the current consecutive region
+            auto meta = transcript.add_signatures();
+            meta->set_seq(seq.substr(last_start,
+                                     start - last_start + FLAGS_rs_length));
             meta->set_position(last_start);
           }
+          is_consecutive = false;
         }
-        gene_signatures_.push_back(result);
-        if (gene_signatures_.size() > 10) {
-          dumper_->dump(gene_signatures_);
-          gene_signatures_.clear();
-        }
       }
+      if (is_consecutive) {
+        auto meta = transcript.add_signatures();
+        meta->set_seq(seq.substr(last_start));
+        meta->set_position(last_start);
+      }
+      dumper_->dump(g, t, &transcript);
     }
-    dumper_->dump(gene_signatures_);
   }
 
 private:
-  SingleFastaReader* reader_;
+  const PackedTranscriptome* transcriptome_;
   RSBloom* dup_bloom_;
+  const KmerPartitions* partitions_;
   IndexDumper* dumper_;
-  std::vector<GeneSignatures> gene_signatures_;
+  KmerCodec codec_;
+  CanonicalCyclicHash hasher_;
 };
 
 class IndexMain {
 public:
+  // the number of the genes which can wait for the earlier ones to be
+  // written, for every lookup thread
+  static const int kPendingGenesPerThread = 64;
+
   IndexMain(const string& transcript_fasta_filename,
             const string& output_file,
             int num_threads)
-    : file_(transcript_fasta_filename),
+    : file_(transcript_fasta_filename), all_bloom_(nullptr),
+      dup_bloom_(nullptr), partitions_(nullptr),
       output_file_(output_file), num_threads_(num_threads) {
+    if (FLAGS_exact_kmers) {
+      LOG_IF(FATAL, FLAGS_rs_length > 64)
+        << "The rs_length must be no more than 64 with -exact_kmers";
+      partitions_ = new KmerPartitions(FLAGS_kmer_partitions,
+                                       FLAGS_kmer_partition_dir);
+      return;
+    }
     const uint64_t total_length = get_file_size(transcript_fasta_filename);
     LOG(INFO) << "The estimated total number of k-mers is " << total_length;
-    all_bloom_ = new RSBloom(total_length * 10, 0.001);
-    dup_bloom_ = new RSBloom(total_length * 10, 0.001);
+    // a k-mer is added once in its canonical orientation, instead of
+    // once in every one of the four orientations (total_length * 10)
+    all_bloom_ = new RSBloom(total_length * 10 / 4, 0.001,
+                             FLAGS_blocked_bloom);
+    dup_bloom_ = new RSBloom(total_length * 10 / 4, 0.001,
+                             FLAGS_blocked_bloom);
   }
 
   void run() {
     LOG(INFO) << "Loading k-mers and transcripts";
     SingleFastaReader* reader_ = new SingleFastaReader(file_, 1);
-    IndexThread index_thread(reader_, all_bloom_, dup_bloom_);
+    PackedTranscriptome transcriptome;
+    IndexThread index_thread(reader_, &transcriptome, all_bloom_, dup_bloom_);
+    PartitionKmerThread partition_thread(reader_, &transcriptome,
+                                         partitions_);
+    ThreadInterface* load_thread = &index_thread;
+    if (partitions_ != nullptr) {
+      load_thread = &partition_thread;
+    }
     std::vector<std::thread> threads(num_threads_);
     for (int i = 0; i < num_threads_; i ++) {
-      threads[i] = std::thread{RSThread(&index_thread)};
+      threads[i] = std::thread{RSThread(load_thread)};
     }
     barrier(threads);
-    LOG(INFO) << "all k-mers are loaded into memory";
-    reader_->reset();
-    IndexDumper dumper(output_file_);
-    LookupUniqueStringThread lookup_thread(reader_, dup_bloom_,
-                                           &dumper);
+    LOG(INFO) << "all k-mers are loaded into memory, with "
+              << transcriptome.size() << " genes of "
+              << transcriptome.num_bases() << " bases";
+    if (partitions_ != nullptr) {
+      partitions_->find_shared(num_threads_);
+      LOG(INFO) << partitions_->num_shared()
+                << " k-mers are shared by more than one gene";
+    }
+    IndexDumper dumper(output_file_, &transcriptome,
+                       num_threads_ * kPendingGenesPerThread);
+    LookupUniqueStringThread lookup_thread(&transcriptome, dup_bloom_,
+                                           partitions_, &dumper);
     vector<LookupUniqueStringThread> lookup_threads(num_threads_,
                                                     lookup_thread);
     for (int i = 0; i < num_threads_; i ++) {
       threads[i] = std::thread{RSThread(&lookup_threads[i])};
     }
+    dumper.write_all();
     barrier(threads);
   }
 
@@ -236,6 +439,10 @@ private:
   // only duplicated rs signature will be added to this bloom
   RSBloom* dup_bloom_;
 
+  // the k-mers of all the genes with -exact_kmers, which is used
+  // instead of the blooms
+  KmerPartitions* partitions_;
+
   string output_file_;
 
   int num_threads_;
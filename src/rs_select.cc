@@ -1,21 +1,22 @@
-// TODO(zzj): make this program multithread
-
-#include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
+#include <omp.h>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "key_table.h"
+#include "kmer_position_index.h"
+#include "packed_kmer.h"
 #include "proto/rnasigs.pb.h"
 #include "proto_data.h"
 #include "rs_common.h"
 
-using std::fstream;
-using std::ios;
 using std::map;
 using std::pair;
 using std::set;
@@ -30,8 +31,108 @@ DEFINE_int32(rs_length, 40,
              "The length of sig-mer.");
 DEFINE_int32(num_kmer_per_region, 10,
              "The number of sig-mers selected from each sig-mer region.");
+DEFINE_bool(columnar_keys, false,
+            "Write the selected keys as a key table, which rs_count and "
+            "rs_estimate map into memory instead of parsing.");
+DEFINE_int32(num_threads, -1,
+             "The num of threads used in the program. "
+             "[default: -1]: the num of CPUs in the machine.");
 using namespace rs;
 
+// The number of the genes read at once, which are processed by all the
+// threads, and then written in the same order as in the index file.
+const int kGenesPerBatch = 1000;
+
+// Returns true if the seq only has A, C, G and T (in the upper case), so
+// two such k-mers are the same strings iff their packed k-mers are the
+// same.
+bool is_packable(const char* seq, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    uint8_t code = nucleotide_code(seq[i]);
+    if (code == kInvalidNucleotide || "ACGT"[code] != seq[i]) return false;
+  }
+  return true;
+}
+
+// The positions of all the k-mers in the sig-mer regions of a gene. The
+// k-mers are packed into a flat hash table, and only the ones with
+// other characters (or all of them if rs_length is larger than 64) are
+// kept as strings.
+class GeneKmerIndex {
+public:
+  GeneKmerIndex()
+    : packed_(FLAGS_rs_length <= 64),
+      codec_(packed_ ? FLAGS_rs_length : 1) {}
+
+  void build(const GeneSignatures& gene) {
+    index_.clear();
+    others_.clear();
+    for (int i = 0; i < gene.transcripts_size(); i ++) {
+      const auto& transcript = gene.transcripts(i);
+      for (int j = 0; j < transcript.signatures_size(); j++) {
+        const auto& sigs = transcript.signatures(j);
+        const string& seq = sigs.seq();
+        // the last k-mer of the region is not indexed.
+        int num_kmers = (int) seq.size() - FLAGS_rs_length;
+        PackedKmer kmer = {0, 0};
+        // the number of the packable characters ending at p
+        int valid = 0;
+        for (int p = 0; p < num_kmers + FLAGS_rs_length - 1; p++) {
+          valid = packed_ && is_packable(&seq[p], 1) ? valid + 1 : 0;
+          if (valid > 0) {
+            codec_.push(&kmer, nucleotide_code(seq[p]));
+          }
+          int k = p - FLAGS_rs_length + 1;
+          if (k < 0) continue;
+          if (valid >= FLAGS_rs_length) {
+            index_.add(kmer, i, sigs.position() + k);
+          } else {
+            others_[seq.substr(k, FLAGS_rs_length)]
+              .push_back(std::make_pair(i, sigs.position() + k));
+          }
+        }
+      }
+    }
+    index_.build();
+  }
+
+  // Calls f(tidx, position) for every position of the key, in all the
+  // four orientations in the order of all_keys.
+  template <typename F>
+  void for_each_position(const string& key, F f) const {
+    PackedKmer kmer;
+    if (packed_ && is_packable(key.data(), key.size()) &&
+        codec_.encode(key, &kmer)) {
+      PackedKmer rc = codec_.reverse_complement(kmer);
+      // the key, reversed, reverse complement and complement
+      PackedKmer orientations[] = {kmer, codec_.complement(rc), rc,
+                                   codec_.complement(kmer)};
+      for (auto& orientation : orientations) {
+        size_t size;
+        const pair<int, int>* positions = index_.find(orientation, &size);
+        if (positions == nullptr) continue;
+        for (size_t i = 0; i < size; i++) {
+          f(positions[i].first, positions[i].second);
+        }
+      }
+      return;
+    }
+    for (auto& iter_key : all_keys(key)) {
+      auto it = others_.find(iter_key);
+      if (it == others_.end()) continue;
+      for (auto& item : it->second) {
+        f(item.first, item.second);
+      }
+    }
+  }
+
+private:
+  bool packed_;
+  KmerCodec codec_;
+  KmerPositionIndex index_;
+  map<string, vector<pair<int, int> > > others_;
+};
+
 void find_all_positions(const string& seq, const string& key,
                         vector<int> *positions, int shift = 0) {
   int position = 0;
@@ -46,157 +147,171 @@ void find_all_positions(const string& seq, const string& key,
   }
 }
 
-int main(int argc, char *argv[]) {
-  google::InitGoogleLogging(argv[0]);
-  google::ParseCommandLineFlags(&argc, &argv, true);
-  int buffer_size = 200000000;
-  ::google::protobuf::uint8 * buffer =
-      new ::google::protobuf::uint8[buffer_size];
-  GeneSignatures gene;
-  fstream istream(FLAGS_index_file, ios::in | ios::binary);
-  fstream ostream(FLAGS_selected_keys_file, ios::out | ios::binary | ios::trunc);
-  long long total_selected_keys = 0;
-  long long total_keys = 0;
-  while(load_protobuf_data(&istream, &gene, buffer, buffer_size)) {
-    set<string> gene_keys;
+// Selects the keys of the gene into sk.
+void select_keys(const GeneSignatures& gene, GeneKmerIndex* key_index,
+                 SelectedKey* sk, long long* total_keys,
+                 long long* total_selected_keys) {
+  set<string> gene_keys;
 
-    // select keys from every transcripts
-    for (int i = 0; i < gene.transcripts_size(); i ++) {
-      const auto& transcript = gene.transcripts(i);
-      int step = std::min(50 + (10 - FLAGS_num_kmer_per_region) * 10,
-                          (transcript.length() - 20) / FLAGS_num_kmer_per_region);
-      if (step < 10) {
-        step = 10;
-      }
-      set<string> signatures;
-      for (int j = 0; j < transcript.signatures_size(); j++) {
-        const auto& sigs = transcript.signatures(j);
-        const string& seq = sigs.seq();
-        int length = seq.length();
-        total_keys += length - FLAGS_rs_length + 1;
-        int start = std::min(20, length - FLAGS_rs_length);
-        for (int p = start; p < length - FLAGS_rs_length; p += step) {
-          string sig = seq.substr(p, FLAGS_rs_length);
-          signatures.insert(first_seq_in_order(sig));
-        }
-      }
-      for (const string& sig : signatures) {
-        gene_keys.insert(sig);
+  // select keys from every transcripts
+  for (int i = 0; i < gene.transcripts_size(); i ++) {
+    const auto& transcript = gene.transcripts(i);
+    int step = std::min(50 + (10 - FLAGS_num_kmer_per_region) * 10,
+                        (transcript.length() - 20) / FLAGS_num_kmer_per_region);
+    if (step < 10) {
+      step = 10;
+    }
+    set<string> signatures;
+    for (int j = 0; j < transcript.signatures_size(); j++) {
+      const auto& sigs = transcript.signatures(j);
+      const string& seq = sigs.seq();
+      int length = seq.length();
+      *total_keys += length - FLAGS_rs_length + 1;
+      int start = std::min(20, length - FLAGS_rs_length);
+      for (int p = start; p < length - FLAGS_rs_length; p += step) {
+        string sig = seq.substr(p, FLAGS_rs_length);
+        signatures.insert(first_seq_in_order(sig));
       }
     }
-    total_selected_keys += gene_keys.size();
-    // LOG(ERROR) << gene_keys.size();
-    // check whether the selected key occurs more than once in the
-    // current gene's transcripts' sequences.
-    SelectedKey sk;
-    sk.set_gid(gene.id());
-    for (int i = 0; i < gene.transcripts_size(); i ++) {
-      const auto& transcript = gene.transcripts(i);
-      sk.add_tids(transcript.id());
-      sk.add_lengths(transcript.length());
+    for (const string& sig : signatures) {
+      gene_keys.insert(sig);
     }
+  }
+  *total_selected_keys += gene_keys.size();
+  // LOG(ERROR) << gene_keys.size();
+  // check whether the selected key occurs more than once in the
+  // current gene's transcripts' sequences.
+  sk->set_gid(gene.id());
+  for (int i = 0; i < gene.transcripts_size(); i ++) {
+    const auto& transcript = gene.transcripts(i);
+    sk->add_tids(transcript.id());
+    sk->add_lengths(transcript.length());
+  }
 
-    map<string, vector<pair<int, int> > > key_index;
-    for (int i = 0; i < gene.transcripts_size(); i ++) {
-      const auto& transcript = gene.transcripts(i);
-      vector<int> positions;
-      for (int j = 0; j < transcript.signatures_size(); j++) {
-        const auto& sigs = transcript.signatures(j);
-        string seq = sigs.seq();
-        for (int k = 0; k < seq.size() - FLAGS_rs_length; k++) {
-          key_index[seq.substr(k, FLAGS_rs_length)]
-            .push_back(std::make_pair(i, sigs.position() + k));
-        }
-      }
-    }
+  key_index->build(gene);
 
-    set<int> skipped_tids;
-    // tid -> sig positions
-    map<int, set<string> > tid2sigs;
+  set<int> skipped_tids;
+  // tid -> sig positions
+  map<int, set<string> > tid2sigs;
 
-    for (auto key : gene_keys) {
-      vector<string> all_keys_result = all_keys(key);
-      for (auto iter_key: all_keys_result) {
-        if (key_index.find(iter_key) != key_index.end()) {
-          for (auto& item : key_index[iter_key]) {
-            tid2sigs[item.first].insert(key);
-          }
-        }
-      }
+  for (auto& key : gene_keys) {
+    key_index->for_each_position(key, [&](int tidx, int) {
+        tid2sigs[tidx].insert(key);
+      });
+  }
+
+  for (auto& item : tid2sigs) {
+    if (item.second.size() <= 2) {
+      LOG(ERROR) << gene.transcripts(item.first).id() << " has "
+                 << item.second.size() << " rna_signatures. Skipped.";
+      skipped_tids.insert(item.first);
     }
+  }
 
-    for (auto& item : tid2sigs) {
-      if (item.second.size() <= 2) {
-        LOG(ERROR) << gene.transcripts(item.first).id() << " has "
-                   << item.second.size() << " rna_signatures. Skipped.";
-        skipped_tids.insert(item.first);
+  for (auto& key : gene_keys) {
+    SelectedKey::Key* key_info = sk->add_keys();
+    key_info->set_key(key);
+    map<int, vector<int> > tid2positions;
+    key_index->for_each_position(key, [&](int tidx, int position) {
+        if (skipped_tids.find(tidx) != skipped_tids.end()) return;
+        tid2positions[tidx].push_back(position);
+      });
+
+    for (auto &item : tid2positions) {
+      SelectedKey::Key::TranscriptInfo* ti = key_info->add_transcript_infos();
+      ti->set_tidx(item.first);
+      for (int position : item.second) {
+        LOG_IF(ERROR, position >= sk->lengths(item.first))
+          << "The position is out of the boundary";
+        ti->add_positions(position);
       }
+      // LOG(ERROR) << item.first;
+      // debug_vector(item.second);
     }
 
-    for (auto key : gene_keys) {
-      SelectedKey::Key* key_info = sk.add_keys();
-      key_info->set_key(key);
-      vector<string> all_keys_result = all_keys(key);
-      map<int, vector<int> > tid2positions;
-      for (auto key: all_keys_result) {
-        if (key_index.find(key) != key_index.end()) {
-          for (auto& item : key_index[key]) {
-            if (skipped_tids.find(item.first) != skipped_tids.end()) continue;
-            tid2positions[item.first].push_back(item.second);
-          }
-        }
-      }
+    // Do not delete this. This is for the future reference.
+    // for (int i = 0; i < gene.transcripts_size(); i ++) {
+    //   const auto& transcript = gene.transcripts(i);
+    //   vector<int> positions;
+    //   for (int j = 0; j < transcript.signatures_size(); j++) {
+    //     const auto& sigs = transcript.signatures(j);
+    //     const string& seq = sigs.seq();
+    //     // performance alert!!!
+    //     // should convert the transcript first.
+    //     // TODO(zzj): fix this later
+    //     for (auto key : all_keys_result) {
+    //       find_all_positions(seq, key, &positions,
+    //                          sigs.position());  // shifted position
+    //     }
+    //   }
+    //   // LOG(ERROR) << i;
+    //   // debug_vector(positions);
+    //   if (positions.size() > 0) {
+    //     SelectedKey::Key::TranscriptInfo* ti = key_info->add_transcript_infos();
+    //     ti->set_tidx(i);
+    //     for (auto position : positions) {
+    //       if (position >= sk.lengths(i)) {
+    //         LOG(ERROR) << "The position is out of the boundary";
+    //       }
+    //       ti->add_positions(position);
+    //     }
+    //   }
+    // }
+  }
+  if (sk->keys_size() == 0) {
+    for (int i = 0; i < sk->tids_size(); i++) {
+      LOG(ERROR) << sk->tids(i) << " does not have any rna_signatures";
+    }
+  }
+}
 
-      for (auto &item : tid2positions) {
-        SelectedKey::Key::TranscriptInfo* ti = key_info->add_transcript_infos();
-        ti->set_tidx(item.first);
-        for (int position : item.second) {
-          LOG_IF(ERROR, position >= sk.lengths(item.first))
-            << "The position is out of the boundary";
-          ti->add_positions(position);
-        }
-        // LOG(ERROR) << item.first;
-        // debug_vector(item.second);
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_num_threads == -1) {
+    FLAGS_num_threads = std::thread::hardware_concurrency();
+  }
+  omp_set_dynamic(0);     // Explicitly disable dynamic teams
+  omp_set_num_threads(FLAGS_num_threads);
+  ProtobufReader reader(FLAGS_index_file);
+  std::unique_ptr<ProtobufWriter> writer;
+  std::unique_ptr<KeyTableWriter> table_writer;
+  if (FLAGS_columnar_keys) {
+    table_writer.reset(new KeyTableWriter(FLAGS_rs_length));
+  } else {
+    writer.reset(new ProtobufWriter(FLAGS_selected_keys_file));
+  }
+  long long total_selected_keys = 0;
+  long long total_keys = 0;
+  vector<GeneSignatures> genes(kGenesPerBatch);
+  vector<SelectedKey> selected_keys(kGenesPerBatch);
+  while (true) {
+    int num_genes = 0;
+    while (num_genes < kGenesPerBatch && reader.read(&genes[num_genes])) {
+      num_genes ++;
+    }
+    if (num_genes == 0) break;
+    #pragma omp parallel reduction(+: total_keys, total_selected_keys)
+    {
+      GeneKmerIndex key_index;
+      #pragma omp for schedule(dynamic)
+      for (int i = 0; i < num_genes; i++) {
+        selected_keys[i].Clear();
+        select_keys(genes[i], &key_index, &selected_keys[i], &total_keys,
+                    &total_selected_keys);
       }
-
-      // Do not delete this. This is for the future reference.
-      // for (int i = 0; i < gene.transcripts_size(); i ++) {
-      //   const auto& transcript = gene.transcripts(i);
-      //   vector<int> positions;
-      //   for (int j = 0; j < transcript.signatures_size(); j++) {
-      //     const auto& sigs = transcript.signatures(j);
-      //     const string& seq = sigs.seq();
-      //     // performance alert!!!
-      //     // should convert the transcript first.
-      //     // TODO(zzj): fix this later
-      //     for (auto key : all_keys_result) {
-      //       find_all_positions(seq, key, &positions,
-      //                          sigs.position());  // shifted position
-      //     }
-      //   }
-      //   // LOG(ERROR) << i;
-      //   // debug_vector(positions);
-      //   if (positions.size() > 0) {
-      //     SelectedKey::Key::TranscriptInfo* ti = key_info->add_transcript_infos();
-      //     ti->set_tidx(i);
-      //     for (auto position : positions) {
-      //       if (position >= sk.lengths(i)) {
-      //         LOG(ERROR) << "The position is out of the boundary";
-      //       }
-      //       ti->add_positions(position);
-      //     }
-      //   }
-      // }
     }
-    if (sk.keys_size() == 0) {
-      for (int i = 0; i < sk.tids_size(); i++) {
-        LOG(ERROR) << sk.tids(i) << " does not have any rna_signatures";
+    for (int i = 0; i < num_genes; i++) {
+      if (table_writer) {
+        table_writer->add(selected_keys[i]);
+      } else {
+        writer->write(selected_keys[i]);
       }
     }
-    write_protobuf_data(&ostream, &sk);
+  }
+  if (table_writer) {
+    table_writer->save(FLAGS_selected_keys_file);
   }
   LOG(ERROR) << total_selected_keys << " sig-mers are selected";
   LOG(ERROR) << total_keys << " sig-mers are scanned";
-  delete buffer;
-
 }
@@ -0,0 +1,40 @@
+#include <utility>
+
+#include "union_find.h"
+
+namespace rs {
+
+UnionFind::UnionFind(size_t size) : parents_(size) {
+  for (size_t i = 0; i < size; i++) {
+    parents_[i].store(i, std::memory_order_relaxed);
+  }
+}
+
+uint32_t UnionFind::find(uint32_t x) {
+  while (true) {
+    uint32_t parent = parents_[x].load();
+    if (parent == x) return x;
+    uint32_t grandparent = parents_[parent].load();
+    // path halving, which is skipped if another thread has changed the
+    // parent of x, which is also closer to the root then.
+    if (grandparent != parent) {
+      parents_[x].compare_exchange_weak(parent, grandparent);
+    }
+    x = grandparent;
+  }
+}
+
+void UnionFind::unite(uint32_t x, uint32_t y) {
+  while (true) {
+    x = find(x);
+    y = find(y);
+    if (x == y) return;
+    if (x > y) std::swap(x, y);
+    // the larger root becomes a child of the smaller one, unless another
+    // thread has linked it first, and then it is tried again.
+    uint32_t expected = y;
+    if (parents_[y].compare_exchange_strong(expected, x)) return;
+  }
+}
+
+}  // namespace rs
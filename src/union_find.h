@@ -0,0 +1,38 @@
+// This is used for finding the connected components of a graph while
+// its edges are found by many threads.
+
+#ifndef RS_UNION_FIND_H
+#define RS_UNION_FIND_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using std::vector;
+
+namespace rs {
+
+// A lock-free union-find (disjoint set) of the nodes 0, 1, ..., size-1.
+// The root of a component is always its smallest node, so the
+// components are the same however the edges are added.
+// This is thread safe.
+class UnionFind {
+public:
+  explicit UnionFind(size_t size);
+
+  // Returns the smallest node in the component of x.
+  uint32_t find(uint32_t x);
+  // Merges the components of x and y.
+  void unite(uint32_t x, uint32_t y);
+  size_t size() const { return parents_.size(); }
+
+private:
+  // the parent of every node is no larger than the node, and the roots
+  // are their own parents.
+  vector<std::atomic<uint32_t> > parents_;
+};
+
+}  // namespace rs
+
+#endif  // RS_UNION_FIND_H
@@ -0,0 +1,51 @@
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "union_find.h"
+
+namespace rs {
+namespace {
+
+TEST(UnionFind, components) {
+  UnionFind components(10);
+  components.unite(3, 7);
+  components.unite(7, 5);
+  components.unite(9, 8);
+  components.unite(5, 3);
+  ASSERT_EQ(3, components.find(3));
+  ASSERT_EQ(3, components.find(5));
+  ASSERT_EQ(3, components.find(7));
+  ASSERT_EQ(8, components.find(9));
+  ASSERT_EQ(0, components.find(0));
+  components.unite(9, 0);
+  ASSERT_EQ(0, components.find(8));
+}
+
+TEST(UnionFind, parallel_unite) {
+  // the nodes with the same remainder of 7 are in the same component,
+  // and every thread adds the edges in a different order
+  const uint32_t kNodes = 70000;
+  UnionFind components(kNodes);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&components, t, kNodes]() {
+          uint32_t step = 7 * (1 + t);
+          for (uint32_t i = step; i < kNodes; i++) {
+            uint32_t x = t % 2 == 0 ? i : kNodes - 1 - i + step;
+            components.unite(x, x - step);
+            components.find(x / 2);
+          }
+        }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (uint32_t i = 0; i < kNodes; i++) {
+    ASSERT_EQ(i % 7, components.find(i));
+  }
+}
+
+}  // namespace
+}  // namespace rs